@@ -0,0 +1,82 @@
+/**
+ * Bandwidth benchmark: rank 0 streams windows of messages to rank 1,
+ * which acknowledges every window once it has received all of it. With
+ * "bi" as the first argument both ranks stream to each other at the same
+ * time. Reports MB/s for sizes 1, 2, 4, ... bytes.
+ *
+ * Usage: mimpirun 2 bench/bw [uni|bi] [max bytes] [iterations]
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../mimpi.h"
+
+// messages in flight at once, as in the OSU benchmarks
+#define WINDOW 64
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char* argv[]) {
+    MIMPI_Init(false);
+
+    bool bidirectional = argc > 1 && strcmp(argv[1], "bi") == 0;
+    int max_bytes = argc > 2 ? atoi(argv[2]) : 1 << 20;
+    int iterations = argc > 3 ? atoi(argv[3]) : 100;
+    int rank = MIMPI_World_rank();
+    int peer = 1 - rank;
+    const char* transport = getenv("MIMPI_TRANSPORT");
+
+    // every message of a window has its own buffer, as the receives are posted together
+    char* send_buf = malloc((size_t) max_bytes * WINDOW);
+    char* recv_buf = malloc((size_t) max_bytes * WINDOW);
+    if (send_buf == NULL || recv_buf == NULL) {
+        fprintf(stderr, "bw: cannot allocate %zu bytes\n", (size_t) max_bytes * WINDOW);
+        return 1;
+    }
+    memset(send_buf, 1, (size_t) max_bytes * WINDOW);
+
+    MIMPI_Request requests[2 * WINDOW];
+    for (int bytes = 1; bytes <= max_bytes && rank < 2; bytes *= 2) {
+        int reps = bytes > 64 * 1024 ? (iterations + 9) / 10 : iterations;
+        int warmup = (reps + 9) / 10;
+        bool sends = rank == 0 || bidirectional;
+        bool receives = rank == 1 || bidirectional;
+
+        double start = 0;
+        for (int i = -warmup; i < reps; i++) {
+            if (i == 0) start = now_ns();
+            int num = 0;
+            for (int j = 0; j < WINDOW && receives; j++) {
+                MIMPI_Irecv(recv_buf + (size_t) j * bytes, bytes, peer, 1, &requests[num++]);
+            }
+            for (int j = 0; j < WINDOW && sends; j++) {
+                MIMPI_Isend(send_buf + (size_t) j * bytes, bytes, peer, 1, &requests[num++]);
+            }
+            MIMPI_Waitall(num, requests);
+
+            // the window counts as sent only once it has arrived
+            char ack = 0;
+            if (rank == 1) MIMPI_Send(&ack, 1, 0, 2);
+            else MIMPI_Recv(&ack, 1, 1, 2);
+        }
+        double elapsed = now_ns() - start;
+
+        if (rank == 0) {
+            double total = (double) bytes * WINDOW * reps * (bidirectional ? 2 : 1);
+            printf("{\"bench\":\"%s\",\"transport\":\"%s\",\"bytes\":%d,\"mbps\":%.2f}\n",
+                   bidirectional ? "bibw" : "bw", transport != NULL ? transport : "pipe", bytes, total / elapsed * 1e3);
+            fflush(stdout);
+        }
+    }
+
+    free(send_buf);
+    free(recv_buf);
+    MIMPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,64 @@
+/**
+ * Ping-pong latency benchmark: rank 0 sends a message to rank 1, which
+ * sends it back, for sizes 0, 1, 2, 4, ... bytes, and reports half of the
+ * round trip time. Other ranks only take part in MIMPI_Init and
+ * MIMPI_Finalize.
+ *
+ * Usage: mimpirun 2 bench/latency [max bytes] [iterations]
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../mimpi.h"
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char* argv[]) {
+    MIMPI_Init(false);
+
+    int max_bytes = argc > 1 ? atoi(argv[1]) : 1 << 20;
+    int iterations = argc > 2 ? atoi(argv[2]) : 1000;
+    int rank = MIMPI_World_rank();
+    const char* transport = getenv("MIMPI_TRANSPORT");
+
+    char* buf = malloc(max_bytes > 0 ? max_bytes : 1);
+    if (buf == NULL) {
+        fprintf(stderr, "latency: cannot allocate %d bytes\n", max_bytes);
+        return 1;
+    }
+
+    for (int bytes = 0; bytes <= max_bytes && rank < 2; bytes = bytes == 0 ? 1 : 2 * bytes) {
+        // large messages take long enough to need fewer round trips
+        int reps = bytes > 64 * 1024 ? (iterations + 9) / 10 : iterations;
+        int warmup = (reps + 9) / 10;
+
+        double start = 0;
+        for (int i = -warmup; i < reps; i++) {
+            if (i == 0) start = now_ns();
+            if (rank == 0) {
+                MIMPI_Send(buf, bytes, 1, 1);
+                MIMPI_Recv(buf, bytes, 1, 1);
+            }
+            else {
+                MIMPI_Recv(buf, bytes, 0, 1);
+                MIMPI_Send(buf, bytes, 0, 1);
+            }
+        }
+        double elapsed = now_ns() - start;
+
+        if (rank == 0) {
+            printf("{\"bench\":\"latency\",\"transport\":\"%s\",\"bytes\":%d,\"us\":%.2f}\n",
+                   transport != NULL ? transport : "pipe", bytes, elapsed / reps / 2 / 1e3);
+            fflush(stdout);
+        }
+    }
+
+    free(buf);
+    MIMPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,93 @@
+/**
+ * Matching stress benchmark: rank 1 floods rank 0 with messages under
+ * distinct tags, then rank 0 receives them in the reverse order, so that
+ * every MIMPI_Recv has to find its message among all still queued ones.
+ * A second flood queues small messages in front of larger ones, which are
+ * then received first with MIMPI_ANY_TAG. Unless MIMPI_CREDITS is set,
+ * the credit budget is sized so that a whole flood fits in it.
+ *
+ * Usage: mimpirun 2 bench/matching [messages]
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../mimpi.h"
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char* argv[]) {
+    int messages = argc > 1 ? atoi(argv[1]) : 100000;
+
+    // rank 0 receives nothing until a flood is over, beyond the budget the sends would
+    // wait for credits forever (a message is charged its size and less than 128 bytes more)
+    char budget[32];
+    snprintf(budget, sizeof(budget), "%zu", (size_t) messages * 128);
+    setenv("MIMPI_CREDITS", budget, 0);
+
+    MIMPI_Init(false);
+
+    int rank = MIMPI_World_rank();
+    const char* transport = getenv("MIMPI_TRANSPORT");
+
+    if (rank == 1) {
+        for (int i = 0; i < messages; i++) {
+            MIMPI_Send(&i, sizeof(int), 0, i + 1);
+        }
+    }
+    // all messages are queued at rank 0 once the barrier completes
+    MIMPI_Barrier();
+
+    double tagged = 0;
+    if (rank == 0) {
+        int value;
+        double start = now_ns();
+        for (int i = messages - 1; i >= 0; i--) {
+            MIMPI_Recv(&value, sizeof(int), 1, i + 1);
+            if (value != i) {
+                fprintf(stderr, "matching: expected %d, got %d\n", i, value);
+                return 1;
+            }
+        }
+        tagged = now_ns() - start;
+    }
+
+    int half = messages / 2;
+    if (rank == 1) {
+        int pair[2];
+        for (int i = 0; i < half; i++) {
+            MIMPI_Send(&i, sizeof(int), 0, i + 1);
+        }
+        for (int i = 0; i < half; i++) {
+            pair[0] = pair[1] = i;
+            MIMPI_Send(pair, sizeof(pair), 0, i + 1);
+        }
+    }
+    MIMPI_Barrier();
+
+    if (rank == 0) {
+        int pair[2];
+        double start = now_ns();
+        for (int i = 0; i < half; i++) {
+            MIMPI_Recv(pair, sizeof(pair), 1, MIMPI_ANY_TAG);
+            if (pair[0] != i) {
+                fprintf(stderr, "matching: expected %d, got %d\n", i, pair[0]);
+                return 1;
+            }
+        }
+        double any = now_ns() - start;
+        for (int i = 0; i < half; i++) {
+            MIMPI_Recv(pair, sizeof(int), 1, MIMPI_ANY_TAG);
+        }
+
+        printf("{\"bench\":\"matching\",\"transport\":\"%s\",\"queued\":%d,\"recv_ns\":%.1f,\"any_tag_recv_ns\":%.1f}\n",
+               transport != NULL ? transport : "pipe", messages, tagged / messages, any / half);
+    }
+
+    MIMPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,83 @@
+/**
+ * Multi-pair message rate benchmark: the first half of the ranks stream
+ * windows of messages to their partners in the second half, all pairs at
+ * the same time, and the aggregate number of messages per second is
+ * reported for sizes 1, 2, 4, ... bytes.
+ *
+ * Usage: mimpirun 2k bench/msgrate [max bytes] [iterations]
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../mimpi.h"
+
+#define WINDOW 64
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char* argv[]) {
+    MIMPI_Init(false);
+
+    int max_bytes = argc > 1 ? atoi(argv[1]) : 4096;
+    int iterations = argc > 2 ? atoi(argv[2]) : 100;
+    int rank = MIMPI_World_rank();
+    int size = MIMPI_World_size();
+    int pairs = size / 2;
+    const char* transport = getenv("MIMPI_TRANSPORT");
+
+    if (pairs == 0) {
+        fprintf(stderr, "msgrate: needs at least 2 ranks\n");
+        return 1;
+    }
+
+    char* buf = malloc((size_t) max_bytes * WINDOW);
+    if (buf == NULL) {
+        fprintf(stderr, "msgrate: cannot allocate %zu bytes\n", (size_t) max_bytes * WINDOW);
+        return 1;
+    }
+    memset(buf, 1, (size_t) max_bytes * WINDOW);
+
+    // with an odd number of ranks the last one only takes part in the barriers
+    bool sender = rank < pairs;
+    bool receiver = rank >= pairs && rank < 2 * pairs;
+    int peer = sender ? rank + pairs : rank - pairs;
+
+    MIMPI_Request requests[WINDOW];
+    for (int bytes = 1; bytes <= max_bytes; bytes *= 2) {
+        int warmup = (iterations + 9) / 10;
+        double start = 0;
+        for (int i = -warmup; i < iterations; i++) {
+            if (i == 0) {
+                MIMPI_Barrier();
+                start = now_ns();
+            }
+            for (int j = 0; j < WINDOW && (sender || receiver); j++) {
+                char* data = buf + (size_t) j * bytes;
+                if (sender) MIMPI_Isend(data, bytes, peer, 1, &requests[j]);
+                else MIMPI_Irecv(data, bytes, peer, 1, &requests[j]);
+            }
+            if (sender || receiver) MIMPI_Waitall(WINDOW, requests);
+        }
+        // the slowest pair finishes last
+        MIMPI_Barrier();
+        double elapsed = now_ns() - start;
+
+        if (rank == 0) {
+            double messages = (double) pairs * WINDOW * iterations;
+            printf("{\"bench\":\"msgrate\",\"transport\":\"%s\",\"pairs\":%d,\"bytes\":%d,\"msgs_per_s\":%.0f,\"mbps\":%.2f}\n",
+                   transport != NULL ? transport : "pipe", pairs, bytes, messages / elapsed * 1e9,
+                   messages * bytes / elapsed * 1e3);
+            fflush(stdout);
+        }
+    }
+
+    free(buf);
+    MIMPI_Finalize();
+    return 0;
+}
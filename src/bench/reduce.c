@@ -0,0 +1,58 @@
+/**
+ * Reduction kernel benchmark: combines two buffers with partially_reduce
+ * for every (datatype, operation) pair and reports the throughput, in GB
+ * of reduced data per second. Runs in a single process, without mimpirun.
+ *
+ * Usage: bench/reduce [bytes] [repetitions]
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../reduce.h"
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static const char* datatype_names[] = { "uint8", "int32", "uint32", "int64", "uint64", "float", "double" };
+static const char* op_names[] = { "max", "min", "sum", "prod" };
+
+int main(int argc, char* argv[]) {
+    size_t bytes = argc > 1 ? strtoull(argv[1], NULL, 10) : 1 << 20;
+    int repetitions = argc > 2 ? atoi(argv[2]) : 200;
+
+    // ones keep products and sums of floating point numbers finite
+    unsigned char* partial = malloc(bytes);
+    unsigned char* update = malloc(bytes);
+    if (partial == NULL || update == NULL) {
+        fprintf(stderr, "reduce: cannot allocate %zu bytes\n", bytes);
+        return 1;
+    }
+
+    for (int datatype = MIMPI_UINT8; datatype <= MIMPI_DOUBLE; datatype++) {
+        int count = bytes / datatype_size(datatype);
+        for (int op = MIMPI_MAX; op <= MIMPI_PROD; op++) {
+            memset(partial, 0, bytes);
+            memset(update, 1, bytes);
+
+            // first pass warms up the caches and resolves the kernel
+            partially_reduce(partial, update, count, datatype, op);
+            double start = now_ns();
+            for (int i = 0; i < repetitions; i++) {
+                partially_reduce(partial, update, count, datatype, op);
+            }
+            double elapsed = now_ns() - start;
+
+            printf("{\"bench\":\"reduce\",\"type\":\"%s\",\"op\":\"%s\",\"bytes\":%zu,\"gbps\":%.2f}\n",
+                   datatype_names[datatype], op_names[op], bytes, (double) bytes * repetitions / elapsed);
+        }
+    }
+
+    free(partial);
+    free(update);
+    return 0;
+}
@@ -0,0 +1,137 @@
+/**
+ * Collective autotuner: times every algorithm of every collective in
+ * tuning.h for message sizes 1, 4, 16, ... bytes up to a maximum, and
+ * prints the fastest ones as rules of a tuning table for the current
+ * number of processes. Link emulation (CHANNELS_LATENCY, CHANNELS_BANDWIDTH,
+ * CHANNELS_JITTER) and the delays set with CHANNELS_WRITE_DELAY and
+ * CHANNELS_READ_DELAY apply as in any other program, so the table can be
+ * tuned for slow links too (with a smaller maximum size).
+ *
+ * Usage: mimpirun n bench/tune [max bytes] [repetitions] >> table
+ *        MIMPI_TUNING=table mimpirun n program
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../mimpi.h"
+#include "../tuning.h"
+
+// another algorithm is taken only when it is faster by this factor
+#define SWITCH_MARGIN 1.1
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int rank, size;
+static char* send_buf;
+static char* recv_buf;
+
+static void run(collective_t collective, int bytes, int repetition) {
+    // roots rotate, so that every process takes its turn
+    int root = repetition % size;
+    switch (collective) {
+        case COLL_BCAST:
+            MIMPI_Bcast(recv_buf, bytes, root);
+            break;
+        case COLL_ALLREDUCE:
+            MIMPI_Allreduce(send_buf, recv_buf, bytes, MIMPI_UINT8, MIMPI_MAX);
+            break;
+        case COLL_GATHER:
+            MIMPI_Gather(send_buf, recv_buf, bytes, root);
+            break;
+        case COLL_SCATTER:
+            MIMPI_Scatter(send_buf, recv_buf, bytes, root);
+            break;
+        case COLL_ALLGATHER:
+            MIMPI_Allgather(send_buf, recv_buf, bytes);
+            break;
+        default:
+            break;
+    }
+}
+
+// time of the slowest process, in microseconds per call
+static double measure(collective_t collective, int algorithm, int bytes, int repetitions) {
+    tuning_force(collective, algorithm);
+    run(collective, bytes, 0);
+    MIMPI_Barrier();
+    double start = now_ns();
+    for (int i = 0; i < repetitions; i++) {
+        run(collective, bytes, i);
+    }
+    double elapsed = (now_ns() - start) / 1e3 / repetitions;
+    tuning_force(collective, -1);
+
+    double slowest;
+    MIMPI_Allreduce(&elapsed, &slowest, 1, MIMPI_DOUBLE, MIMPI_MAX);
+    return slowest;
+}
+
+int main(int argc, char* argv[]) {
+    MIMPI_Init(false);
+
+    int max_bytes = argc > 1 ? atoi(argv[1]) : 1 << 20;
+    int repetitions = argc > 2 ? atoi(argv[2]) : 50;
+    rank = MIMPI_World_rank();
+    size = MIMPI_World_size();
+
+    // gather, scatter and allgather move a block per process
+    send_buf = malloc((size_t) max_bytes * size);
+    recv_buf = malloc((size_t) max_bytes * size);
+    if (send_buf == NULL || recv_buf == NULL) {
+        fprintf(stderr, "tune: cannot allocate %zu bytes\n", (size_t) max_bytes * size);
+        return 1;
+    }
+    memset(send_buf, 1, (size_t) max_bytes * size);
+
+    if (rank == 0) {
+        const char* write_delay = getenv("CHANNELS_WRITE_DELAY");
+        const char* read_delay = getenv("CHANNELS_READ_DELAY");
+        const char* latency = getenv("CHANNELS_LATENCY");
+        const char* bandwidth = getenv("CHANNELS_BANDWIDTH");
+        const char* jitter = getenv("CHANNELS_JITTER");
+        printf("# %d processes, write delay %s ms, read delay %s ms\n", size,
+               write_delay != NULL ? write_delay : "0", read_delay != NULL ? read_delay : "0");
+        printf("# latency %s us, jitter %s us, bandwidth %s MB/s\n", latency != NULL ? latency : "0",
+               jitter != NULL ? jitter : "0", bandwidth != NULL ? bandwidth : "unlimited");
+    }
+
+    for (collective_t c = 0; c < NUM_COLLECTIVES; c++) {
+        int previous = -1;
+        for (int bytes = 1; bytes <= max_bytes; bytes *= 4) {
+            // fewer repetitions of larger messages
+            int reps = bytes >= 64 * 1024 ? (repetitions + 3) / 4 : repetitions;
+            double times[num_algorithms(c)];
+            int best = 0;
+            for (int a = 0; a < num_algorithms(c); a++) {
+                times[a] = measure(c, a, bytes, reps);
+                if (times[a] < times[best]) best = a;
+            }
+            double best_time = times[best];
+
+            // noise should not flip the table back and forth between sizes
+            if (previous != -1 && times[previous] <= best_time * SWITCH_MARGIN) {
+                best = previous;
+                best_time = times[previous];
+            }
+
+            // a rule is needed only where the fastest algorithm changes
+            if (rank == 0 && best != previous) {
+                printf("%s %d %d %s # %.1f us\n", collective_name(c), size, previous == -1 ? 0 : bytes,
+                       algorithm_name(c, best), best_time);
+                fflush(stdout);
+            }
+            previous = best;
+        }
+    }
+
+    free(send_buf);
+    free(recv_buf);
+    MIMPI_Finalize();
+    return 0;
+}
@@ -4,14 +4,22 @@ Might be changed during testing,
 but as stated in the assignment description the provided functions' behaviour
 shouldn't observably differ in any way other than execution duration.
 */
+#define _GNU_SOURCE // ppoll
 #include "channel.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -53,25 +61,283 @@ static int msleep(long msec)
 
 #define WRITE_VAR "CHANNELS_WRITE_DELAY"
 #define READ_VAR "CHANNELS_READ_DELAY"
+#define LATENCY_VAR "CHANNELS_LATENCY"
+#define BANDWIDTH_VAR "CHANNELS_BANDWIDTH"
+#define JITTER_VAR "CHANNELS_JITTER"
 #define ATOMIC_BLOCK_SIZE 512
 
-pthread_mutex_t mutex;
+// descriptors below this get a link of their own (channel ends of a rank are far below)
+#define MAX_LINKS 1024
+// bytes a link holds in flight if the capacity of its channel is unknown
+#define DEFAULT_LINK_CAPACITY 65536
 
-static void delay(const char *delay_var, const size_t size)
+// milliseconds per started block of ATOMIC_BLOCK_SIZE bytes, the original per-call delay
+static long write_delay_ms;
+static long read_delay_ms;
+
+// link emulation: a write takes the link for size / bandwidth after the bytes written
+// before it, and reaches the channel latency plus up to jitter after that
+static uint64_t latency_ns;
+static uint64_t jitter_ns;
+static uint64_t bandwidth; // bytes per second, 0 if unlimited
+static bool emulated;
+
+// bytes of one write, held back until the link has carried them
+typedef struct Chunk
+{
+    struct Chunk *next;
+    uint64_t due;
+    size_t size;
+    size_t written;
+    char data[];
+} chunk_t;
+
+// write end of a channel, its chunks go to the channel in order
+typedef struct Link
 {
-    ASSERT_ZERO(pthread_mutex_lock(&mutex));
+    chunk_t *front;
+    chunk_t *rear;
+    size_t queued;       // bytes in flight, at most capacity
+    size_t capacity;     // that of the channel, 0 until the first write
+    uint64_t busy_until; // when the link has carried the bytes written so far
+    uint64_t last_due;   // of the last chunk queued, chunks never overtake
+    bool blocked;        // the channel was full, the link thread waits until it has room
+    int error;           // errno of a failed write, returned by the next chsend
+    unsigned seed;       // of the jitter
+} link_t;
+
+// the link thread writes due chunks; chsend only queues them, so that no caller,
+// least of all the worker, sleeps for a link and holds up the others
+static link_t links[MAX_LINKS];
+static int active[MAX_LINKS]; // descriptors of links with chunks queued
+static int num_active;
+static uint64_t next_wakeup;  // when the link thread will look at the links again
+static bool stopping;
+static int wakeup_fd;         // eventfd, for chunks due before next_wakeup
+static pthread_t link_thread;
+static pthread_mutex_t links_mutex;
+static pthread_cond_t links_flushed;
+static pthread_cond_t links_room;     // a link has carried some bytes or its channel is full
 
-    const char *delay_str = getenv(delay_var);
-    if (delay_str)
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t parse_var(const char *var)
+{
+    const char *str = getenv(var);
+    return str != NULL ? strtoull(str, NULL, 10) : 0;
+}
+
+static void delay(long delay_ms, const size_t size)
+{
+    if (delay_ms > 0)
+    {
+        msleep((size + ATOMIC_BLOCK_SIZE - 1) / ATOMIC_BLOCK_SIZE * delay_ms);
+    }
+}
+
+static void drop_chunks(link_t *link)
+{
+    while (link->front != NULL)
     {
-        int delay_ms = atoi(delay_str);
-        if (delay_ms > 0)
+        chunk_t *chunk = link->front;
+        link->front = chunk->next;
+        free(chunk);
+    }
+    link->rear = NULL;
+    link->queued = 0;
+}
+
+// write the chunks of fd that are due, each with a single write, so that one of up to
+// PIPE_BUF bytes stays atomic (assumes locked links_mutex, which is released while writing;
+// only the link thread takes chunks off a queue)
+static void write_due(int fd, uint64_t now)
+{
+    link_t *link = &links[fd];
+    while (link->front != NULL && link->front->due <= now)
+    {
+        chunk_t *chunk = link->front;
+        ASSERT_ZERO(pthread_mutex_unlock(&links_mutex));
+        ssize_t res = write(fd, chunk->data + chunk->written, chunk->size - chunk->written);
+        int error = errno;
+        ASSERT_ZERO(pthread_mutex_lock(&links_mutex));
+        if (res == -1 && error == EINTR)
+            continue;
+        if (res == -1 && error == EAGAIN)
         {
-            msleep((size + ATOMIC_BLOCK_SIZE - 1) / ATOMIC_BLOCK_SIZE * delay_ms);
+            link->blocked = true;
+            return;
         }
+        if (res == -1)
+        {
+            // the reader is gone, what it has not got is lost as with a plain write
+            link->error = error;
+            drop_chunks(link);
+            return;
+        }
+        chunk->written += res;
+        link->queued -= res;
+        if (chunk->written < chunk->size)
+            continue;
+
+        link->front = chunk->next;
+        if (link->front == NULL)
+            link->rear = NULL;
+        free(chunk);
     }
-    // Defaults to not wait
-    ASSERT_ZERO(pthread_mutex_unlock(&mutex));
+}
+
+static void *run_links(void *unused)
+{
+    (void)unused;
+    // the default slack of 50 us would dwarf short delays
+    prctl(PR_SET_TIMERSLACK, 1UL);
+
+    struct pollfd fds[MAX_LINKS + 1];
+    ASSERT_ZERO(pthread_mutex_lock(&links_mutex));
+    while (!stopping)
+    {
+        uint64_t now = now_ns();
+        uint64_t wakeup = UINT64_MAX;
+        int nfds = 1;
+        fds[0] = (struct pollfd){ .fd = wakeup_fd, .events = POLLIN };
+        for (int k = 0; k < num_active;)
+        {
+            int fd = active[k];
+            link_t *link = &links[fd];
+            if (!link->blocked)
+                write_due(fd, now);
+            if (link->front == NULL)
+            {
+                active[k] = active[--num_active];
+                continue;
+            }
+            if (link->blocked)
+                fds[nfds++] = (struct pollfd){ .fd = fd, .events = POLLOUT };
+            else if (link->front->due < wakeup)
+                wakeup = link->front->due;
+            k++;
+        }
+        ASSERT_ZERO(pthread_cond_broadcast(&links_room));
+        if (num_active == 0)
+            ASSERT_ZERO(pthread_cond_broadcast(&links_flushed));
+        next_wakeup = wakeup;
+        ASSERT_ZERO(pthread_mutex_unlock(&links_mutex));
+
+        struct timespec timeout;
+        if (wakeup != UINT64_MAX)
+        {
+            uint64_t left = wakeup > now ? wakeup - now : 0;
+            timeout = (struct timespec){ .tv_sec = left / 1000000000, .tv_nsec = left % 1000000000 };
+        }
+        if (ppoll(fds, nfds, wakeup != UINT64_MAX ? &timeout : NULL, NULL) > 0 && fds[0].revents != 0)
+        {
+            uint64_t count;
+            if (read(wakeup_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+                perror("link emulation: read");
+        }
+
+        ASSERT_ZERO(pthread_mutex_lock(&links_mutex));
+        next_wakeup = 0;
+        for (int i = 1; i < nfds; i++)
+        {
+            if (fds[i].revents != 0)
+                links[fds[i].fd].blocked = false;
+        }
+    }
+    ASSERT_ZERO(pthread_mutex_unlock(&links_mutex));
+    return NULL;
+}
+
+// bytes of a write of n the link of fd takes now: all of them up to PIPE_BUF, so that
+// the write stays atomic, otherwise as many as fit into one piece, 0 if the write has to wait
+// (assumes locked links_mutex)
+static size_t link_room(int fd, size_t n)
+{
+    link_t *link = &links[fd];
+    if (link->capacity == 0)
+    {
+        int capacity = fcntl(fd, F_GETPIPE_SZ);
+        link->capacity = capacity > 0 ? (size_t)capacity : DEFAULT_LINK_CAPACITY;
+    }
+    size_t room = link->capacity - link->queued;
+    if (room < n && room < PIPE_BUF)
+        return 0;
+    if (n <= PIPE_BUF)
+        return n;
+
+    // a large write is taken in pieces, so that the link carries one while the next is queued
+    size_t piece = link->capacity / 4 > PIPE_BUF ? link->capacity / 4 : PIPE_BUF;
+    size_t size = room < n ? room : n;
+    return size < piece ? size : piece;
+}
+
+// queue up to n bytes of iov on the link of fd, they count as written; like a write to
+// a non-blocking pipe, it fails with EAGAIN while the channel behind a full link is full
+// too, and while it only waits for the link to carry bytes in flight, it sleeps, so that
+// a caller polling the channel does not spin
+static ssize_t link_send(int fd, const struct iovec *iov, int iovcnt, size_t n)
+{
+    link_t *link = &links[fd];
+    ASSERT_ZERO(pthread_mutex_lock(&links_mutex));
+    size_t size;
+    while (link->error == 0 && (size = link_room(fd, n)) == 0 && !link->blocked)
+        ASSERT_ZERO(pthread_cond_wait(&links_room, &links_mutex));
+    chunk_t *chunk = NULL;
+    int error = link->error != 0 ? link->error : size == 0 ? EAGAIN : 0;
+    if (error == 0 && (chunk = malloc(sizeof(chunk_t) + size)) == NULL)
+        error = ENOMEM;
+    if (error != 0)
+    {
+        ASSERT_ZERO(pthread_mutex_unlock(&links_mutex));
+        errno = error;
+        return -1;
+    }
+
+    size_t offset = 0;
+    for (int i = 0; i < iovcnt && offset < size; i++)
+    {
+        size_t len = iov[i].iov_len < size - offset ? iov[i].iov_len : size - offset;
+        memcpy(chunk->data + offset, iov[i].iov_base, len);
+        offset += len;
+    }
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->written = 0;
+
+    uint64_t now = now_ns();
+    uint64_t start = link->busy_until > now ? link->busy_until : now;
+    link->busy_until = start + (bandwidth != 0 ? size * 1000000000 / bandwidth : 0);
+    chunk->due = link->busy_until + latency_ns;
+    if (jitter_ns > 0)
+        chunk->due += (uint64_t)rand_r(&link->seed) % (jitter_ns + 1);
+    if (chunk->due < link->last_due)
+        chunk->due = link->last_due;
+    link->last_due = chunk->due;
+
+    if (link->front == NULL)
+    {
+        link->front = chunk;
+        active[num_active++] = fd;
+    }
+    else
+        link->rear->next = chunk;
+    link->rear = chunk;
+    link->queued += size;
+    bool wake = chunk->due < next_wakeup && !link->blocked;
+    ASSERT_ZERO(pthread_mutex_unlock(&links_mutex));
+
+    if (wake)
+    {
+        uint64_t one = 1;
+        if (write(wakeup_fd, &one, sizeof(one)) == -1)
+            perror("link emulation: write");
+    }
+    return size;
 }
 
 int channel(int pipefd[2])
@@ -82,25 +348,90 @@ int channel(int pipefd[2])
 void channels_init() {
     signal(SIGPIPE, SIG_IGN);
 
-    pthread_mutexattr_t attr;
-    ASSERT_ZERO(pthread_mutexattr_init(&attr));
-    ASSERT_ZERO(pthread_mutex_init(&mutex, &attr));
-    ASSERT_ZERO(pthread_mutexattr_destroy(&attr));
+    write_delay_ms = parse_var(WRITE_VAR);
+    read_delay_ms = parse_var(READ_VAR);
+    latency_ns = parse_var(LATENCY_VAR) * 1000;
+    jitter_ns = parse_var(JITTER_VAR) * 1000;
+    bandwidth = parse_var(BANDWIDTH_VAR) * 1000000;
+    emulated = latency_ns != 0 || jitter_ns != 0 || bandwidth != 0;
+    if (!emulated)
+        return;
+
+    for (int fd = 0; fd < MAX_LINKS; fd++)
+    {
+        links[fd] = (link_t){ .seed = (unsigned)getpid() * MAX_LINKS + fd };
+    }
+    num_active = 0;
+    next_wakeup = 0;
+    stopping = false;
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd == -1)
+        perror("link emulation: eventfd");
+    ASSERT_ZERO(pthread_mutex_init(&links_mutex, NULL));
+    ASSERT_ZERO(pthread_cond_init(&links_flushed, NULL));
+    ASSERT_ZERO(pthread_cond_init(&links_room, NULL));
+    ASSERT_ZERO(pthread_create(&link_thread, NULL, run_links, NULL));
+}
+
+void channels_flush() {
+    if (!emulated)
+        return;
+
+    ASSERT_ZERO(pthread_mutex_lock(&links_mutex));
+    while (num_active > 0)
+        ASSERT_ZERO(pthread_cond_wait(&links_flushed, &links_mutex));
+    ASSERT_ZERO(pthread_mutex_unlock(&links_mutex));
 }
 
 void channels_finalize() {
-    ASSERT_ZERO(pthread_mutex_destroy(&mutex));
+    if (!emulated)
+        return;
+
+    ASSERT_ZERO(pthread_mutex_lock(&links_mutex));
+    stopping = true;
+    ASSERT_ZERO(pthread_mutex_unlock(&links_mutex));
+    uint64_t one = 1;
+    if (write(wakeup_fd, &one, sizeof(one)) == -1)
+        perror("link emulation: write");
+    ASSERT_ZERO(pthread_join(link_thread, NULL));
+
+    for (int k = 0; k < num_active; k++)
+    {
+        drop_chunks(&links[active[k]]);
+    }
+    close(wakeup_fd);
+    ASSERT_ZERO(pthread_cond_destroy(&links_flushed));
+    ASSERT_ZERO(pthread_cond_destroy(&links_room));
+    ASSERT_ZERO(pthread_mutex_destroy(&links_mutex));
 }
 
 int chsend(int __fd, const void *__buf, size_t __n)
 {
-    delay(WRITE_VAR, __n);
+    delay(write_delay_ms, __n);
+    if (emulated && __n > 0 && __fd >= 0 && __fd < MAX_LINKS)
+    {
+        struct iovec iov = { .iov_base = (void *)__buf, .iov_len = __n };
+        return link_send(__fd, &iov, 1, __n);
+    }
     return write(__fd, __buf, __n);
 }
 
+int chsendv(int __fd, const struct iovec *__iov, int __iovcnt)
+{
+    size_t n = 0;
+    for (int i = 0; i < __iovcnt; i++)
+    {
+        n += __iov[i].iov_len;
+    }
+    delay(write_delay_ms, n);
+    if (emulated && n > 0 && __fd >= 0 && __fd < MAX_LINKS)
+        return link_send(__fd, __iov, __iovcnt, n);
+    return writev(__fd, __iov, __iovcnt);
+}
+
 int chrecv(int __fd, void *__buf, size_t __nbytes)
 {
     ssize_t res = read(__fd, __buf, __nbytes);
-    delay(READ_VAR, __nbytes);
+    delay(read_delay_ms, __nbytes);
     return res;
 }
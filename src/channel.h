@@ -9,6 +9,7 @@ Overview rules to apply:
 #ifndef CHANNEL_H
 #define CHANNEL_H
 #include <stddef.h>
+#include <sys/uio.h>
 
 /*
 This is required to be called in MIMPI_Init.
@@ -20,6 +21,12 @@ This is required to be called in MIMPI_Finalize.
 */
 void channels_finalize();
 
+/*
+Waits until everything sent on channels has reached them (link emulation holds bytes back
+for a while); required before closing a channel's write end.
+*/
+void channels_flush();
+
 /*
 Works similarly to `pipe`, but possibly takes more time to finish.
 */
@@ -29,6 +36,11 @@ Works similarly to `write`, but possibly takes more time to finish.
 */
 int chsend(int __fd, const void *__buf, size_t __n);
 /*
+Works similarly to `writev`, but possibly takes more time to finish.
+Gives the same atomicity guarantee as `chsend` for the total size.
+*/
+int chsendv(int __fd, const struct iovec *__iov, int __iovcnt);
+/*
 Works similarly to `read`, but possibly takes more time to finish.
 */
 int chrecv(int __fd, void *__buf, size_t __nbytes);
@@ -2,462 +2,2361 @@
  * This file is for implementation of MIMPI library.
  * */
 
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <time.h>
 #include "channel.h"
 #include "mimpi.h"
 #include "mimpi_common.h"
+#include "pool.h"
+#include "reduce.h"
+#include "ring.h"
+#include "stats.h"
+#include "trace.h"
+#include "tuning.h"
+
+// events fetched by a single epoll_wait and messages read from a channel per event
+#define EPOLL_BATCH 64
+#define MAX_DRAIN 16
+
+static transport_t transport;
+static channel_table_t channels;
+static segment_t segment;
 
 static bool detection;
-static bool deadlock;
 
 static int my_world_rank;
 static int my_world_size;
 
-volatile static int match_source;
-volatile static int match_tag;
-volatile static int match_count;
-volatile static char* match_data;
-
 static bool* exited;
-volatile static int num_exited;
-
-static int parent;
-static int left;
-static int right;
-static int num_children;
+static atomic_int num_exited;
 
-static struct pollfd* fds;
+static int epoll_fd;
+static partial_t* partials;
 static pthread_t worker;
+
+// peer_mutex[i] guards exited[i], buffers[i], posted[i], sendq[i], sending[i],
+// rndv_pending[i], rndv_bound[i], rndv_seq[i], the flow control and deadlock detection
+// state of i and requests queued there;
+// worker_mutex guards the rest of the shared state.
+// A thread holds at most one peer_mutex, and may lock worker_mutex while holding it
+static pthread_mutex_t* peer_mutex;
 static pthread_mutex_t worker_mutex;
-static pthread_cond_t wait_recv;
-static pthread_cond_t wait_group;
+static pthread_cond_t wait_sends;
 
 static buffer_t** buffers;
-static buffer_t* log;
-
-static bool check_deadlock(int source, int tag, int count) {
-    node_t* curr = log->front;
-    fprintf(stderr, "enter\n");
-    while (curr != NULL) {
-        fprintf(stderr, "%d %d %d\n", *(curr->data), curr->tag, curr->count);
-        if (*(curr->data) == (char)source && curr->tag == tag && curr->count == count) break;
-        curr = curr->next;
-    }
-    if (curr == NULL) return false;
-    curr = curr->next;
-    while (curr != NULL) {
-        if (*(curr->data) == (char)16 && curr->tag == tag && curr->count == count) return false;
-        curr = curr->next;
+static request_queue_t* posted;
+
+static request_queue_t* sendq;   // sends to i not yet written in full, in order
+static bool* sending;            // a thread is writing to channel my_world_rank -> i
+static bool* send_active;
+static int* active_sends;        // destinations whose sends the worker should progress
+static int num_active_sends;
+static int* worker_sends;
+static int num_pending_sends;
+static bool kick_pending;
+static bool closing;             // MIMPI_Finalize flushed the sends, nothing more is queued
+
+static size_t eager_limit;
+static request_queue_t* rndv_pending; // rendezvous sends to i waiting for CTS
+static request_queue_t* rndv_bound;   // receives from i that CTS was sent for, in order
+static int* rndv_seq;                 // sequence number of the next rendezvous send to i
+
+// an eager message is charged against the receiver's budget for its sender,
+// once the budget is used up sends to it wait, in order, until it returns credits
+static size_t credit_limit;
+static size_t* credits;          // bytes this process may still send eagerly to i
+static request_queue_t* stalled; // sends to i waiting for credits, and all sends to i after them
+static size_t* returned;         // bytes of messages from i consumed but not yet credited back
+static bool* starved;            // i waits for credits, they go back as soon as any are returned
+
+// messages on channels this process -> i and i -> this process so far, in channel order,
+// which gives both ends of a message the same trace id
+static uint32_t* flow_written;
+static uint32_t* flow_arrived;
+
+// the probes of one initiator passed on last, all of them along the receive of one wait
+typedef struct Passed {
+    uint32_t wait;
+    uint32_t first;
+    uint32_t last;
+    int from;     // the process the last one came from
+} passed_t;
+
+// deadlock detection chases edges of the wait-for graph: a thread blocked in a receive sends
+// a probe to its source, a process blocked itself passes it on along its own blocked receives,
+// and a probe that comes back to the wait it started from has gone around a cycle;
+// a hop counts only if no message between its ends is still on the way, which could end a wait
+static uint32_t* messages_out;   // messages started to i (eager, announced by RTS or CREDIT)
+static uint32_t* messages_in;    // messages from i matched with a receive or buffered
+static int* blocked_on;          // receives from i a thread is blocked in
+static int num_blocked;          // receives any thread is blocked in
+static int num_threads;          // live threads that have sent or received, a blocked process has only one
+static uint32_t wait_seq;
+static uint32_t probe_seq;
+static uint64_t probe_delay;     // microseconds a thread sleeps on a receive before it probes
+static int failed_initiator;     // the probe that found the cycle the last failed wait was on
+static uint32_t failed_probe;
+static passed_t* passed;         // passed[i] - probes of process i passed on, only used by the worker
+
+// wakeup object of an application thread, requests it waits for point to it
+typedef struct Waiter {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned seq; // bumped by every wakeup
+} waiter_t;
+
+static __thread waiter_t this_thread = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+static __thread bool this_thread_counted = false;
+static pthread_key_t thread_key; // set in counted threads, so that their exit uncounts them
+
+static void uncount_thread(void* arg) {
+    (void) arg;
+    __atomic_fetch_sub(&num_threads, 1, __ATOMIC_RELAXED);
+}
+
+static void count_thread() {
+    if (this_thread_counted) return;
+    this_thread_counted = true;
+    __atomic_fetch_add(&num_threads, 1, __ATOMIC_RELAXED);
+    ASSERT_ZERO(pthread_setspecific(thread_key, &this_thread));
+}
+
+// a process with other threads may go on while one is blocked, deadlock detection leaves it out
+static bool single_threaded() {
+    return __atomic_load_n(&num_threads, __ATOMIC_RELAXED) == 1;
+}
+
+static unsigned waiter_seq(waiter_t* waiter) {
+    ASSERT_ZERO(pthread_mutex_lock(&waiter->mutex));
+    unsigned seq = waiter->seq;
+    ASSERT_ZERO(pthread_mutex_unlock(&waiter->mutex));
+    return seq;
+}
+
+// sleep until waiter is woken up after 'seen' was read
+static void waiter_wait(waiter_t* waiter, unsigned seen) {
+    ASSERT_ZERO(pthread_mutex_lock(&waiter->mutex));
+    while (waiter->seq == seen) {
+        ASSERT_ZERO(pthread_cond_wait(&waiter->cond, &waiter->mutex));
     }
-    return true;
+    ASSERT_ZERO(pthread_mutex_unlock(&waiter->mutex));
 }
 
-static void handle_poll_error(int source) {
-    char* code = NULL;
-    if (fds[source].revents & POLLERR) code = "POLLERR";
-    if (fds[source].revents & POLLNVAL) code = "POLLNVAL";
-    if (code != NULL) {
-        fprintf(stderr, "Poll error: fd %d, channel %d -> %d, code %s\n", fds[source].fd, source, my_world_rank, code);
-        assert(false);
+// as waiter_wait, but gives up at deadline (CLOCK_REALTIME, the clock of the condition);
+// false if it did
+static bool waiter_wait_until(waiter_t* waiter, unsigned seen, struct timespec const* deadline) {
+    ASSERT_ZERO(pthread_mutex_lock(&waiter->mutex));
+    int ret = 0;
+    while (waiter->seq == seen && ret != ETIMEDOUT) {
+        ret = pthread_cond_timedwait(&waiter->cond, &waiter->mutex, deadline);
+        assert(ret == 0 || ret == ETIMEDOUT);
     }
+    bool woken = waiter->seq != seen;
+    ASSERT_ZERO(pthread_mutex_unlock(&waiter->mutex));
+    return woken;
 }
 
-static void handle_incoming_message(int source) {
-    int fd = fds[source].fd;
+// wake the thread waiting for req, if any (assumes locked peer_mutex[req->peer])
+static void wake_request(request_t* req) {
+    waiter_t* waiter = req->waiter;
+    if (waiter == NULL) return;
 
-    // read tag
-    int tag;
-    read_full(fd, &tag, sizeof(int));
+    ASSERT_ZERO(pthread_mutex_lock(&waiter->mutex));
+    waiter->seq++;
+    ASSERT_ZERO(pthread_cond_signal(&waiter->cond));
+    ASSERT_ZERO(pthread_mutex_unlock(&waiter->mutex));
+}
 
-    // read count
-    int count;
-    read_full(fd, &count, sizeof(int));
+// every posted receive is to be checked again (e.g. it fails since source has exited)
+static void wake_posted(int source) {
+    ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[source]));
 
-    if (detection && tag == DEADLOCK_TAG) {
-        node_t* tmp = (node_t*) malloc(sizeof(node_t));
-        read_full(fd, tmp, sizeof(node_t));
+    for (request_t* req = posted[source].front; req != NULL; req = req->next) {
+        wake_request(req);
+    }
 
-        ASSERT_ZERO(pthread_mutex_lock(&worker_mutex));
+    ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[source]));
+}
+
+static void handle_epoll_error(int source, uint32_t events) {
+    if (events & EPOLLERR) {
+        fprintf(stderr, "Epoll error: fd %d, channel %d -> %d, code EPOLLERR\n", channels.read_fds[source], source, my_world_rank);
+        assert(false);
+    }
+}
 
-        buffer_add(log, tmp->tag, tmp->count, tmp->data);
-        fprintf(stderr, "%d %d %d\n", 1, tmp->tag, tmp->count);
+// frame of a message sent to destination's inbound channel (in case of TRANSPORT_MUX)
+static void send_frame(int destination, int tag, int count, const char* data, int length) {
+    frame_header_t header = { .source = my_world_rank, .tag = tag, .count = count, .length = length };
+    struct iovec iov[2] = {
+        { .iov_base = &header, .iov_len = sizeof(header) },
+        { .iov_base = (char*) data, .iov_len = length },
+    };
 
-        ASSERT_ZERO(pthread_mutex_unlock(&worker_mutex));
+    // frames are not larger than CHANNEL_ATOMIC_SIZE, so frames of different senders never interleave
+    writev_full(channels.write_fds[destination], iov, 2);
+}
+
+// split a message into frames, each carrying the source rank
+static void send_frames(int destination, int tag, int count, const char* data) {
+    int offset = 0;
+    do {
+        int length = MIN(count - offset, (int)FRAME_PAYLOAD_SIZE);
+        send_frame(destination, tag, count, data + offset, length);
+        offset += length;
+    } while (offset < count);
+}
+
+// send tag, count and data as one message
+static void send_message(int destination, int tag, int count, const void* data) {
+    if (transport == TRANSPORT_MUX) {
+        send_frames(destination, tag, count, data);
+        return;
     }
-    else {
-        // allocate memory for data and read it
-        char* data = (char*) malloc(count * sizeof(char));
-        assert(data != NULL);
-        read_full(fd, data, count);
 
-        ASSERT_ZERO(pthread_mutex_lock(&worker_mutex));
+    int header[2] = { tag, count };
 
-        buffer_add(buffers[source], tag, count, data);
+    if (transport == TRANSPORT_SHM) {
+        // the ring has a single producer, so header and data can be written separately
+        ring_write_full(&segment, my_world_rank, destination, header, sizeof(header));
+        ring_write_full(&segment, my_world_rank, destination, data, count);
+        return;
+    }
 
-        ASSERT_ZERO(pthread_mutex_unlock(&worker_mutex));
+    // header and user data go out in one gathered write, without copying data
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = sizeof(header) },
+        { .iov_base = (void*) data, .iov_len = count },
+    };
+    writev_full(channels.write_fds[destination], iov, 2);
+}
+
+// write frames of a queued send while the inbound channel takes them without blocking
+static bool try_send_frames(request_t* req) {
+    int fd = channels.write_fds[req->peer];
+    size_t num_frames = req->count == 0 ? 1 : (req->count + FRAME_PAYLOAD_SIZE - 1) / FRAME_PAYLOAD_SIZE;
+    while (req->sent < num_frames) {
+        int offset = req->sent * FRAME_PAYLOAD_SIZE;
+        int length = MIN(req->count - offset, (int)FRAME_PAYLOAD_SIZE);
+        frame_header_t header = { .source = my_world_rank, .tag = req->tag, .count = req->count, .length = length };
+        struct iovec iov[2] = {
+            { .iov_base = &header, .iov_len = sizeof(header) },
+            { .iov_base = req->data + offset, .iov_len = length },
+        };
+
+        // a frame is written as a whole or not at all
+        ssize_t written = chsendv(fd, iov, 2);
+        if (written == -1 && errno == EINTR) continue;
+        if (written == -1 && errno == EAGAIN) return false;
+        ASSERT_SYS_OK(written);
+        assert(written == (ssize_t)(sizeof(header) + length));
+        req->sent++;
     }
+    return true;
 }
 
-static void handle_signal_recv(int source) {
-    // assumes locked mutex
-    if (detection && match_source == source) {
-        deadlock = deadlock || check_deadlock(source, match_tag, match_count);
-        if (deadlock) {
-            ASSERT_ZERO(pthread_cond_signal(&wait_recv));
+// write as much of a queued send as its channel takes without blocking,
+// true once it is written in full (assumes sending[req->peer] is held)
+static bool try_send(request_t* req) {
+    if (transport == TRANSPORT_MUX) return try_send_frames(req);
+
+    int destination = req->peer;
+    int header[2] = { req->tag, req->count };
+    size_t total = sizeof(header) + req->count;
+    while (req->sent < total) {
+        // what is left of the header, then what is left of the data
+        struct iovec iov[2];
+        int iovcnt = 0;
+        if (req->sent < sizeof(header)) {
+            iov[iovcnt++] = (struct iovec) { .iov_base = (char*) header + req->sent, .iov_len = sizeof(header) - req->sent };
         }
-    }
-    else if (match_source == source && match_data == NULL) {
-        match_data = extract_matching_data(buffers[match_source], match_tag, match_count);
-        if (match_data != NULL || exited[match_source]) {
-            ASSERT_ZERO(pthread_cond_signal(&wait_recv));
+        size_t data_sent = req->sent < sizeof(header) ? 0 : req->sent - sizeof(header);
+        if (data_sent < (size_t) req->count) {
+            iov[iovcnt++] = (struct iovec) { .iov_base = req->data + data_sent, .iov_len = req->count - data_sent };
+        }
+
+        size_t written;
+        if (transport == TRANSPORT_SHM) {
+            written = ring_write(&segment, my_world_rank, destination, iov[0].iov_base, iov[0].iov_len);
+            if (written == 0) {
+                if (ring_wait_writable(&segment, my_world_rank, destination)) return false;
+                continue;
+            }
+            doorbell_ring(&segment, destination);
         }
+        else {
+            ssize_t ret = chsendv(channels.write_fds[destination], iov, iovcnt);
+            if (ret == -1 && errno == EINTR) continue;
+            if (ret == -1 && errno == EAGAIN) return false;
+            ASSERT_SYS_OK(ret);
+            written = ret;
+        }
+        req->sent += written;
     }
+    return true;
 }
 
-// poll read fds of channels i -> my_world_rank
-static void poll_transfer_read_init() {
-    for (int i = 0; i < my_world_size; i++) {
-        fds[i].fd = get_transfer_read_fd(i, my_world_rank);
-        fds[i].events = POLLIN;
-        fds[i].revents = 0;
+// queue sends to destination for the worker's next round
+static void activate_sends(int destination) {
+    ASSERT_ZERO(pthread_mutex_lock(&worker_mutex));
+
+    if (!send_active[destination]) {
+        send_active[destination] = true;
+        active_sends[num_active_sends++] = destination;
     }
+
+    ASSERT_ZERO(pthread_mutex_unlock(&worker_mutex));
 }
 
-// worker thread code
-static void* worker_runnable(void* arg) {
-    (void) arg;
-    while (true) {
-        // poll is used with timeout set to -1, which means no timeout
-        ASSERT_SYS_OK(poll(fds, my_world_size, -1));
+// wake the worker up, so that it picks up newly queued sends
+static void kick_worker() {
+    if (transport == TRANSPORT_SHM) {
+        doorbell_ring(&segment, my_world_rank);
+        return;
+    }
 
-        for (int i = 0; i < my_world_size; i++) {
-            handle_poll_error(i);
-            if (fds[i].revents & POLLIN) {
-                // fprintf(stderr, "POLLIN  %d -> %d\n", i, my_world_rank);
-                // incoming message
-                handle_incoming_message(i);
+    // one wake-up message in flight is enough
+    ASSERT_ZERO(pthread_mutex_lock(&worker_mutex));
+    bool needed = !kick_pending;
+    kick_pending = true;
+    ASSERT_ZERO(pthread_mutex_unlock(&worker_mutex));
+    if (!needed) return;
 
-                ASSERT_ZERO(pthread_mutex_lock(&worker_mutex));
+    send_message(my_world_rank, KICK_TAG, 0, NULL);
+}
 
-                handle_signal_recv(i);
+static void finish_send(request_t* req, MIMPI_Retcode ret) {
+    // assumes locked peer_mutex[req->peer]
+    if (req->detached) {
+        pool_free(req->data, req->count);
+        pool_free(req, sizeof(request_t));
+    }
+    else {
+        req->in_progress = false;
+        req->done = true;
+        req->ret = ret;
+        wake_request(req);
+    }
 
-                ASSERT_ZERO(pthread_mutex_unlock(&worker_mutex));
-            }
-            else if ((fds[i].revents & POLLHUP) && !exited[i]) {
-                // fprintf(stderr, "POLLHUP %d -> %d\n", i, my_world_rank);
-                // process 'i' is in MIMPI_Finalize and its channel is empty
+    ASSERT_ZERO(pthread_mutex_lock(&worker_mutex));
+    if (--num_pending_sends == 0) {
+        ASSERT_ZERO(pthread_cond_broadcast(&wait_sends));
+    }
+    ASSERT_ZERO(pthread_mutex_unlock(&worker_mutex));
+}
 
-                ASSERT_ZERO(pthread_mutex_lock(&worker_mutex));
+// a message starts being written to its channel (assumes locked peer_mutex[req->peer])
+static void trace_write_start(request_t* req) {
+    if (!trace_enabled()) return;
 
-                exited[i] = true;
-                handle_signal_recv(i);
+    req->flow = trace_flow_id(my_world_rank, req->peer, ++flow_written[req->peer]);
+    req->write_started = trace_clock();
+}
 
-                ASSERT_ZERO(pthread_mutex_unlock(&worker_mutex));
+static void trace_write_end(request_t* req) {
+    trace_message(TRACE_WRITE, req->write_started, req->peer, req->tag, req->count, req->flow);
+}
 
-                if (++num_exited == my_world_size) return NULL;
-            }
-        }
+// resume sends to destination once its channel has room
+static void wait_writable(int destination) {
+    if (transport == TRANSPORT_SHM) {
+        // the consumer rings this process' doorbell when it frees space
+        activate_sends(destination);
+        return;
+    }
+
+    struct epoll_event event = { .events = EPOLLOUT | EPOLLONESHOT, .data.u32 = my_world_size + destination };
+    int fd = channels.write_fds[destination];
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1) {
+        assert(errno == ENOENT);
+        ASSERT_SYS_OK(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event));
     }
 }
 
-void MIMPI_Init(bool enable_deadlock_detection) {
-    deadlock = false;
-    detection = enable_deadlock_detection;
-    channels_init();
+// write queued sends to destination in order until its channel is full
+static void progress_sends(int destination) {
+    ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[destination]));
+
+    while (sendq[destination].front != NULL && !sending[destination]) {
+        request_t* req = sendq[destination].front;
+        if (!req->in_progress) {
+            if (exited[destination]) {
+                // only sends not started yet may fail, others must not leave a torn message behind
+                request_queue_remove(&sendq[destination], req);
+                finish_send(req, MIMPI_ERROR_REMOTE_FINISHED);
+                continue;
+            }
+            req->in_progress = true;
+            trace_write_start(req);
+        }
 
-    my_world_rank = MIMPI_World_rank();
-    my_world_size = MIMPI_World_size();
+        sending[destination] = true;
+        ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[destination]));
 
-    // close transfer channels that do not belong to this process
-    close_foreign_transfer_fds(my_world_rank, my_world_size);
+        bool finished = try_send(req);
 
-    // close unnecessary transfer channel ends
-    close_my_incoming_transfer_write_fds(my_world_rank, my_world_size);
-    close_my_outgoing_transfer_read_fds(my_world_rank, my_world_size);
+        ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[destination]));
+        sending[destination] = false;
 
-    match_source = -1;
-    match_tag = -1;
-    match_count = -1;
-    match_data = NULL;
+        if (!finished) {
+            wait_writable(destination);
+            break;
+        }
+        request_queue_remove(&sendq[destination], req);
+        trace_write_end(req);
+        finish_send(req, MIMPI_SUCCESS);
+    }
 
-    num_exited = 0;
+    ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[destination]));
+}
 
-    parent = (my_world_rank - 1) / 2;
-    left = 2 * my_world_rank + 1;
-    right = 2 * my_world_rank + 2;
-    num_children = (left < my_world_size) + (right < my_world_size);
+static void progress_active_sends() {
+    // callers may activate more destinations meanwhile
+    ASSERT_ZERO(pthread_mutex_lock(&worker_mutex));
 
-    exited = (bool*) malloc(my_world_size * sizeof(bool));
-    buffers = (buffer_t**) malloc(my_world_size * sizeof(buffer_t*));
-    fds = (struct pollfd*) malloc(my_world_size * sizeof(struct pollfd));
-    assert(exited != NULL);
-    assert(buffers != NULL);
-    assert(fds != NULL);
+    int count = num_active_sends;
+    memcpy(worker_sends, active_sends, count * sizeof(int));
+    num_active_sends = 0;
+    for (int k = 0; k < count; k++) {
+        send_active[worker_sends[k]] = false;
+    }
 
-    for (int i = 0; i < my_world_size; i++) {
-        exited[i] = false;
-        buffers[i] = buffer_create();
+    ASSERT_ZERO(pthread_mutex_unlock(&worker_mutex));
+
+    for (int k = 0; k < count; k++) {
+        progress_sends(worker_sends[k]);
     }
+}
 
-    log = (buffer_t*) malloc(sizeof(buffer_t));
-    assert(log != NULL);
-    log = buffer_create();
+// hand a send over to the worker, false if MIMPI_Finalize has already
+// flushed the channels (assumes locked peer_mutex[req->peer])
+static bool queue_send(request_t* req) {
+    ASSERT_ZERO(pthread_mutex_lock(&worker_mutex));
+    bool queued = !closing;
+    if (queued) num_pending_sends++;
+    ASSERT_ZERO(pthread_mutex_unlock(&worker_mutex));
+    if (!queued) return false;
 
-    // start worker thread that polls incoming channels
-    poll_transfer_read_init();
-    ASSERT_ZERO(pthread_mutex_init(&worker_mutex, NULL));
-    ASSERT_ZERO(pthread_cond_init(&wait_recv, NULL));
-    ASSERT_ZERO(pthread_cond_init(&wait_group, NULL));
-    ASSERT_ZERO(pthread_create(&worker, NULL, worker_runnable, NULL));
+    request_queue_add(&sendq[req->peer], req);
+    activate_sends(req->peer);
+    return true;
 }
 
-void MIMPI_Finalize() {
-    // generate POLLHUP in every worker for every one of my outgoing channels
-    close_my_outgoing_transfer_write_fds(my_world_rank, my_world_size);
+// queue a rendezvous control message, the worker sends it on its next round
+// (assumes locked peer_mutex[destination], callers other than the worker kick it)
+static void queue_control(int destination, int tag, const void* payload, int size) {
+    request_t* req = (request_t*) pool_alloc(sizeof(request_t));
+    char* data = (char*) pool_alloc(size);
+    memcpy(data, payload, size);
+    *req = (request_t) {
+        .kind = REQUEST_SEND, .peer = destination, .tag = tag, .count = size, .data = data,
+        .sent = 0, .in_progress = false, .done = false, .blocking = false, .detached = true,
+        .ret = MIMPI_SUCCESS, .waiter = NULL, .next = NULL,
+    };
+
+    if (!queue_send(req)) {
+        pool_free(data, size);
+        pool_free(req, sizeof(request_t));
+        return;
+    }
+    stats_sent(destination, tag, size);
+}
 
-    // synchronize on all processes' MIMPI_Finalize (beacuse worker only returns when all processes have sent exit_event)
-    ASSERT_ZERO(pthread_join(worker, NULL));
+// memory an eager message may take at the receiver: the payload and the node queuing it
+static size_t eager_charge(int count) {
+    return count + sizeof(node_t);
+}
 
-    // close channel ends that were polled by worker
-    close_my_incoming_transfer_read_fds(my_world_rank, my_world_size);
+// (assumes locked peer_mutex[source])
+static void send_credits(int source) {
+    messages_out[source]++;
+    queue_control(source, CREDIT_TAG, &returned[source], sizeof(size_t));
+    returned[source] = 0;
+    starved[source] = false;
+}
 
-    // destroy pthread variables
-    ASSERT_ZERO(pthread_mutex_destroy(&worker_mutex));
-    ASSERT_ZERO(pthread_cond_destroy(&wait_recv));
-    ASSERT_ZERO(pthread_cond_destroy(&wait_group));
+// an eager message from source was consumed, credits go back in batches of half the budget,
+// or right away if source waits for them (assumes locked peer_mutex[source]);
+// true if a CREDIT message was queued
+static bool return_credits(int source, int count) {
+    returned[source] += eager_charge(count);
+    if (!starved[source] && returned[source] < credit_limit / 2) return false;
 
-    // fprintf(stderr, "rank %d\n", my_world_rank);
-    for (int i = 0; i < my_world_size; i++) {
-        buffer_destroy(buffers[i]);
-    }
+    send_credits(source);
+    return true;
+}
 
-    free(exited);
-    free(buffers);
-    free(log);
-    free(fds);
+// only the envelope goes now, the data once the receiver answers with CTS
+// (assumes locked peer_mutex[req->peer], callers other than the worker kick it)
+static void start_rendezvous(request_t* req) {
+    messages_out[req->peer]++;
+    req->seq = rndv_seq[req->peer]++;
+    request_queue_add(&rndv_pending[req->peer], req);
+    int rts[3] = { req->tag, req->count, req->seq };
+    queue_control(req->peer, RTS_TAG, rts, sizeof(rts));
+}
 
-    assert(match_source == -1);
-    assert(match_tag == -1);
-    assert(match_count == -1);
-    assert(match_data == NULL);
+// the receive matches a send announced by RTS, the data will be written
+// straight into it once the sender gets CTS (assumes locked peer_mutex[req->peer])
+static void bind_receive(request_t* req, int seq) {
+    req->in_progress = true;
+    request_queue_add(&rndv_bound[req->peer], req);
+    queue_control(req->peer, CTS_TAG, &seq, sizeof(seq));
+}
 
-    channels_finalize();
+// the receive will never be matched (assumes locked peer_mutex[req->peer])
+static void fail_receive(request_t* req, MIMPI_Retcode ret) {
+    request_queue_remove(&posted[req->peer], req);
+    req->done = true;
+    req->ret = ret;
 }
 
-int MIMPI_World_size() {
-    return atoi(getenv("MIMPI_WORLD_SIZE"));
+// the rendezvous send fails, but its RTS is out already: a copy of the data takes its place,
+// to be written should the receiver post a matching receive after all (assumes locked peer_mutex[req->peer])
+static void abandon_send(request_t* req, MIMPI_Retcode ret) {
+    request_t* copy = (request_t*) pool_alloc(sizeof(request_t));
+    *copy = *req;
+    copy->data = (char*) pool_alloc(req->count);
+    memcpy(copy->data, req->data, req->count);
+    copy->blocking = false;
+    copy->detached = true;
+    copy->waiter = NULL;
+    copy->wait = 0;
+    request_queue_remove(&rndv_pending[req->peer], req);
+    request_queue_add(&rndv_pending[req->peer], copy);
+
+    req->done = true;
+    req->ret = ret;
 }
 
-int MIMPI_World_rank() {
-    return atoi(getenv("MIMPI_WORLD_RANK"));
+// a rendezvous send that gets CTS only once MIMPI_Finalize has flushed the channels is never
+// written; nobody can wait for it any more (assumes locked peer_mutex[req->peer])
+static void drop_send(request_t* req) {
+    assert(!req->blocking);
+    if (req->detached) pool_free(req->data, req->count);
+    pool_free(req, sizeof(request_t));
 }
 
-MIMPI_Retcode MIMPI_Send(void const* data, int count, int destination, int tag) {
-    // check for errors
-    if (destination == my_world_rank) {
-        return MIMPI_ERROR_ATTEMPTED_SELF_OP;
-    }
-    if (destination < 0 || destination >= my_world_size) {
-        return MIMPI_ERROR_NO_SUCH_RANK;
+// start the sends waiting for credits, in order, as far as the credits reach
+// (assumes locked peer_mutex[destination], callers other than the worker kick it)
+static void release_stalled(int destination) {
+    while (stalled[destination].front != NULL) {
+        request_t* req = stalled[destination].front;
+        bool eager = (size_t) req->count <= eager_limit;
+        if (eager && eager_charge(req->count) > credits[destination]) {
+            // the receiver returns credits once it consumes a message, however few
+            size_t none = 0;
+            queue_control(destination, CREDIT_TAG, &none, sizeof(none));
+            return;
+        }
+        request_queue_remove(&stalled[destination], req);
+
+        if (!eager) {
+            start_rendezvous(req);
+            continue;
+        }
+        messages_out[destination]++;
+        credits[destination] -= eager_charge(req->count);
+        if (!queue_send(req)) drop_send(req);
     }
+}
 
-    ASSERT_ZERO(pthread_mutex_lock(&worker_mutex));
+// the send waiting for credits fails, nothing of it has been sent (assumes locked peer_mutex[req->peer])
+static void fail_stalled(request_t* req, MIMPI_Retcode ret) {
+    request_queue_remove(&stalled[req->peer], req);
+    req->done = true;
+    req->ret = ret;
+    release_stalled(req->peer);
+}
 
-    if (exited[destination]) {
-        ASSERT_ZERO(pthread_mutex_unlock(&worker_mutex));
-        return MIMPI_ERROR_REMOTE_FINISHED;
+static bool queued_in(request_queue_t* queue, request_t* req) {
+    for (request_t* queued = queue->front; queued != NULL; queued = queued->next) {
+        if (queued == req) return true;
     }
+    return false;
+}
 
-    ASSERT_ZERO(pthread_mutex_unlock(&worker_mutex));
-
-    char* combined1 = merge_data(&tag, sizeof(int), &count, sizeof(int));
-    char* combined2 = merge_data(combined1, 2 * sizeof(int), data, count);
+// send a probe along a blocked receive, with what has been received from its source
+// so far (assumes locked peer_mutex[destination], callers other than the worker kick it)
+static void send_probe(int destination, probe_t probe) {
+    probe.received = messages_in[destination];
+    queue_control(destination, DEADLOCK_TAG, &probe, sizeof(probe));
+}
 
-    write_full(get_transfer_write_fd(my_world_rank, destination), combined2, 2 * sizeof(int) + (size_t)count);
+// a probe of the calling process' own for a receive a thread is blocked in
+// (assumes locked peer_mutex[req->peer])
+static void start_probe(request_t* req) {
+    probe_t probe = {
+        .initiator = my_world_rank, .wait = req->wait,
+        .probe = __atomic_add_fetch(&probe_seq, 1, __ATOMIC_RELAXED), .found = false,
+    };
 
-    free(combined1);
-    free(combined2);
+    ASSERT_ZERO(pthread_mutex_lock(&worker_mutex));
+    probe.failed_initiator = failed_initiator;
+    probe.failed_probe = failed_probe;
+    ASSERT_ZERO(pthread_mutex_unlock(&worker_mutex));
 
-    if (detection && tag >= 0) {
-        ASSERT_ZERO(pthread_mutex_lock(&worker_mutex));
+    send_probe(req->peer, probe);
+}
 
-        fprintf(stderr, "send: tag: %d count: %d dest: %d\n", tag, count, destination);
-        buffer_add(log, tag, count, &(char) {16});
+// a message from source arrived, the waits blocked on source probe again, since earlier
+// probes may have been dropped while it was on the way (assumes locked peer_mutex[source])
+static void reprobe(int source) {
+    if (blocked_on[source] == 0) return;
 
-        ASSERT_ZERO(pthread_mutex_unlock(&worker_mutex));
+    request_queue_t* queues[3] = { &posted[source], &rndv_pending[source], &stalled[source] };
+    for (int i = 0; i < 3; i++) {
+        for (request_t* req = queues[i]->front; req != NULL; req = req->next) {
+            if (req->wait != 0) start_probe(req);
+        }
+    }
+}
 
+static request_t* find_blocked_in(request_queue_t* queue, uint32_t wait) {
+    for (request_t* req = queue->front; req != NULL; req = req->next) {
+        if (req->wait != 0 && (wait == 0 || req->wait == wait)) return req;
     }
+    return NULL;
+}
 
-    return MIMPI_SUCCESS;
+// the receive, or the send waiting for CTS or credits, a thread of this process is blocked in
+// for the given wait, if it is still blocked (any blocked one for wait 0, assumes locked peer_mutex[source])
+static request_t* find_blocked(int source, uint32_t wait) {
+    if (blocked_on[source] == 0) return NULL;
+
+    request_t* req = find_blocked_in(&posted[source], wait);
+    if (req == NULL) req = find_blocked_in(&rndv_pending[source], wait);
+    return req != NULL ? req : find_blocked_in(&stalled[source], wait);
 }
 
-MIMPI_Retcode MIMPI_Recv(void* data, int count, int source, int tag) {
-    // check for errors
-    if (source == my_world_rank) {
-        return MIMPI_ERROR_ATTEMPTED_SELF_OP;
-    }
-    if (source < 0 || source >= my_world_size) {
-        return MIMPI_ERROR_NO_SUCH_RANK;
+// true if a thread is still blocked in the wait
+static bool still_blocked(uint32_t wait) {
+    bool blocked = false;
+    for (int i = 0; i < my_world_size && !blocked; i++) {
+        ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[i]));
+        blocked = find_blocked(i, wait) != NULL;
+        ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[i]));
     }
+    return blocked;
+}
 
-    ASSERT_ZERO(pthread_mutex_lock(&worker_mutex));
+// true if the probe is one of those passed on along passed[initiator].wait
+static bool has_passed(int initiator, uint32_t probe) {
+    return passed[initiator].first <= probe && probe <= passed[initiator].last;
+}
 
-    match_data = extract_matching_data(buffers[source], tag, count);
+// the cycle is failed backwards, from the initiator to the process the probe came back from and so on
+static void send_found(int destination, const probe_t* probe) {
+    probe_t found = { .initiator = probe->initiator, .probe = probe->probe, .found = true };
 
-    if (match_data == NULL && !exited[source] && detection) {
-        ASSERT_ZERO(pthread_mutex_unlock(&worker_mutex));
+    ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[destination]));
+    send_probe(destination, found);
+    ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[destination]));
+}
 
-        node_t* tosend = node_create(tag, count, &(char) {my_world_rank});
-        MIMPI_Send(tosend, sizeof(node_t), source, DEADLOCK_TAG);
-        // node_destroy(tosend);
+// the probe went around a cycle the wait is on, the process it came from hears of it
+// before any probe the waiting thread sends once woken up
+static void fail_wait(uint32_t wait, int from, const probe_t* probe) {
+    if (!still_blocked(wait)) return;
+    if (from != probe->initiator) send_found(from, probe);
 
-        ASSERT_ZERO(pthread_mutex_lock(&worker_mutex));
+    ASSERT_ZERO(pthread_mutex_lock(&worker_mutex));
+    failed_initiator = probe->initiator;
+    failed_probe = probe->probe;
+    ASSERT_ZERO(pthread_mutex_unlock(&worker_mutex));
+
+    for (int i = 0; i < my_world_size; i++) {
+        ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[i]));
+
+        request_t* req = find_blocked(i, wait);
+        if (req != NULL) {
+            if (req->kind == REQUEST_RECV) fail_receive(req, MIMPI_ERROR_DEADLOCK_DETECTED);
+            else if (queued_in(&stalled[i], req)) fail_stalled(req, MIMPI_ERROR_DEADLOCK_DETECTED);
+            else abandon_send(req, MIMPI_ERROR_DEADLOCK_DETECTED);
+            wake_request(req);
+        }
 
-        deadlock = deadlock || check_deadlock(source, tag, count);
+        ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[i]));
     }
+}
+
+// pass the probe on to every process this one is blocked on
+static void pass_probe(int source, const probe_t* probe) {
+    passed_t* passed_on = &passed[probe->initiator];
+    for (int i = 0; i < my_world_size; i++) {
+        ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[i]));
+
+        request_t* req = find_blocked(i, 0);
+        if (req != NULL) {
+            if (req->wait != passed_on->wait) passed_on->first = probe->probe;
+            passed_on->wait = req->wait;
+            passed_on->last = probe->probe;
+            passed_on->from = source;
+            send_probe(i, *probe);
+        }
 
-    while (match_data == NULL && !exited[source] && !deadlock) {
-        match_source = source;
-        match_tag = tag;
-        match_count = count;
-        ASSERT_ZERO(pthread_cond_wait(&wait_recv, &worker_mutex));
-        match_source = -1;
-        match_tag = -1;
-        match_count = -1;
+        ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[i]));
     }
+}
 
-    int ret;
-    if (match_data != NULL) {
-        memcpy(data, (char*)match_data, count);
-        free((char*)match_data);
-        match_data = NULL;
-        ret = MIMPI_SUCCESS;
+// source is blocked in a receive from this process, or the process this one
+// passed the probe on to found that it has gone around a cycle
+static void handle_probe(int source, const probe_t* probe) {
+    if (__atomic_load_n(&num_blocked, __ATOMIC_RELAXED) == 0 || !single_threaded()) return;
+
+    passed_t* passed_on = &passed[probe->initiator];
+    if (probe->found) {
+        // only the wait the probe was passed on along is on the cycle
+        if (has_passed(probe->initiator, probe->probe)) fail_wait(passed_on->wait, passed_on->from, probe);
+        return;
     }
-    else if (deadlock)
-        ret = MIMPI_ERROR_DEADLOCK_DETECTED;
-    else {
-        assert(exited[source]);
-        ret = MIMPI_ERROR_REMOTE_FINISHED;
+
+    // a message to source still on its way may end the wait of source
+    ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[source]));
+    bool in_flight = messages_out[source] != probe->received;
+    ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[source]));
+    if (in_flight) return;
+
+    if (probe->initiator == my_world_rank) {
+        fail_wait(probe->wait, source, probe);
+        return;
     }
 
-    ASSERT_ZERO(pthread_mutex_unlock(&worker_mutex));
+    // every probe goes through a process once, so it cannot circle forever around a cycle it did not start on
+    if (probe->probe <= passed_on->last) return;
 
-    return ret;
-}
+    // a wait on the cycle the initiator's last failed wait was on fails too once the news
+    // get here, which the probe may have overtaken
+    if (probe->failed_probe != 0 && has_passed(probe->failed_initiator, probe->failed_probe)
+        && still_blocked(passed[probe->failed_initiator].wait)) return;
 
-MIMPI_Retcode MIMPI_Barrier() {
-    char buf;
+    pass_probe(source, probe);
+}
 
-    // wait for children to enter this function
-    for (int i = 0; i < num_children; i++) {
-        MIMPI_CHECK(MIMPI_Recv(&buf, 1, left + i, BARRIER_TAG));
-        assert(buf == BARRIER_WAIT);
+// read what has already arrived in channel source -> my_world_rank, never blocks
+static size_t recv_available(int source, void* data, size_t count) {
+    if (count == 0) return 0;
+    if (transport == TRANSPORT_SHM) {
+        return ring_read(&segment, source, my_world_rank, data, count);
     }
 
-    if (my_world_rank != 0) {
-        // notify parent that this process has entered this function or propagate error
-        MIMPI_CHECK(MIMPI_Send(&(char) {BARRIER_WAIT}, 1, parent, BARRIER_TAG));
+    ssize_t bytes_read;
+    do {
+        bytes_read = chrecv(channels.read_fds[source], data, count);
+    } while (bytes_read == -1 && errno == EINTR);
+    if (bytes_read == -1 && errno == EAGAIN) return 0;
+    ASSERT_SYS_OK(bytes_read);
+    return bytes_read;
+}
+
+// queue a complete message from source, takes ownership of data
+static void store_message(int source, int tag, int count, char* data) {
+    ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[source]));
 
-        // wait for parent to wake this process up or register error
-        MIMPI_CHECK(MIMPI_Recv(&buf, 1, parent, BARRIER_TAG));
-        assert(buf == BARRIER_WAKE);
-    }
+    messages_in[source]++;
 
-    // wake up children or propagate error
-    for (int i = 0; i < num_children; i++) {
-        MIMPI_CHECK(MIMPI_Send(&(char) {BARRIER_WAKE}, 1, left + i, BARRIER_TAG));
+    // a matching receive may have been posted while the message was being read
+    request_t* req = request_queue_take_matching(&posted[source], tag, count);
+    if (req != NULL) {
+        memcpy(req->data, data, count);
+        pool_free(data, count);
+        req->done = true;
+        wake_request(req);
+        return_credits(source, count);
     }
+    else {
+        buffer_add(buffers[source], tag, count, data);
+        stats_buffered(source, 1);
+    }
+    reprobe(source);
 
-    return MIMPI_SUCCESS;
+    ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[source]));
 }
 
-static bool is_bcast_path(int v, int root) {
-    if (v == root) return true;
-    int curr = root;
-    while (curr != 0) {
-        curr = (curr - 1) / 2;
-        if (curr == v) return true;
+// take the receive a new message from source should go to, if one is already posted
+static request_t* take_posted_receive(int source, int tag, int count) {
+    if (tag == RTS_TAG || tag == CTS_TAG || tag == CREDIT_TAG || tag == DEADLOCK_TAG) return NULL;
+
+    ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[source]));
+
+    request_t* req;
+    if (tag == RNDV_DATA_TAG) {
+        // rendezvous data comes in the order CTS messages were sent
+        req = rndv_bound[source].front;
+        assert(req != NULL && req->count == count);
+        request_queue_remove(&rndv_bound[source], req);
     }
-    return false;
+    else {
+        req = request_queue_take_matching(&posted[source], tag, count);
+        if (req != NULL) {
+            req->in_progress = true;
+            messages_in[source]++;
+            reprobe(source);
+        }
+    }
+
+    ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[source]));
+
+    return req;
 }
 
-MIMPI_Retcode MIMPI_Bcast(void* data, int count, int root) {
-    // check error
-    if (root < 0 || root >= my_world_size) return MIMPI_ERROR_NO_SUCH_RANK;
+// data of a posted receive has been written in full, eager if it was charged credits
+static void complete_receive(request_t* req, bool eager) {
+    int source = req->peer;
+    ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[source]));
+
+    req->in_progress = false;
+    req->done = true;
+    wake_request(req);
+    if (eager) return_credits(source, req->count);
 
-    char* buf = (char*) malloc(count * sizeof(char));
-    assert(buf != NULL);
+    ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[source]));
+}
 
-    // to be safe initialize our data to zeros
-    if (my_world_rank != root) memset(data, 0, count);
+// wake-up message sent by this process to itself
+static void handle_kick() {
+    ASSERT_ZERO(pthread_mutex_lock(&worker_mutex));
 
-    // wait for children to enter this function
-    for (int i = 0; i < num_children; i++) {
-        MIMPI_CHECK1(MIMPI_Recv(buf, count, left + i, BCAST_TAG), buf);
-        if (is_bcast_path(left + i, root)) {
-            // receive bcast data from child
-            memcpy(data, buf, count);
-        }
-    }
+    kick_pending = false;
 
-    free(buf);
+    ASSERT_ZERO(pthread_mutex_unlock(&worker_mutex));
+}
 
-    if (my_world_rank != 0) {
-        // notify parent that we are waiting
-        MIMPI_CHECK(MIMPI_Send(data, count, parent, BCAST_TAG));
+// source announced a send larger than eager_limit, only its envelope is buffered
+// until a matching receive is posted
+static void handle_rts(int source, const int* rts) {
+    int tag = rts[0], count = rts[1], seq = rts[2];
 
-        // wait for parent to send bcast data or register error
-        MIMPI_CHECK(MIMPI_Recv(data, count, parent, BCAST_TAG));
+    ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[source]));
+
+    messages_in[source]++;
+    request_t* req = request_queue_take_matching(&posted[source], tag, count);
+    if (req != NULL) bind_receive(req, seq);
+    else {
+        buffer_add_envelope(buffers[source], tag, count, seq);
+        stats_buffered(source, 1);
     }
+    reprobe(source);
 
-    // send bcast data to children or propagate error
-    for (int i = 0; i < num_children; i++) {
-        MIMPI_CHECK(MIMPI_Send(data, count, left + i, BCAST_TAG));
+    ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[source]));
+}
+
+// source posted the receive for the rendezvous send with sequence number seq
+static void handle_cts(int source, int seq) {
+    ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[source]));
+
+    request_t* req = rndv_pending[source].front;
+    while (req != NULL && req->seq != seq) req = req->next;
+    // a stray CTS, or one for a send MIMPI_Finalize has dropped
+    if (req == NULL) {
+        ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[source]));
+        return;
     }
+    request_queue_remove(&rndv_pending[source], req);
 
-    return MIMPI_SUCCESS;
+    // the receiver takes rendezvous data by arrival order, not by tag
+    req->tag = RNDV_DATA_TAG;
+    if (!queue_send(req)) drop_send(req);
+
+    ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[source]));
 }
 
-MIMPI_Retcode MIMPI_Reduce(void const* send_data, void* recv_data, int count, MIMPI_Op op, int root) {
-    // check error
-    if (root < 0 || root >= my_world_size) return MIMPI_ERROR_NO_SUCH_RANK;
+// source consumed eager messages from this process, or asks for credits with none
+static void handle_credit(int source, size_t amount) {
+    ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[source]));
 
-    u_int8_t* partial = (u_int8_t*) malloc(count * sizeof(u_int8_t));
-    assert(partial != NULL);
-    u_int8_t* buf = (u_int8_t*) malloc(count * sizeof(u_int8_t));
-    assert(buf != NULL);
+    if (amount == 0) {
+        if (returned[source] > 0) send_credits(source);
+        else starved[source] = true;
+    }
+    else {
+        messages_in[source]++;
+        credits[source] += amount;
+        release_stalled(source);
+        reprobe(source);
+    }
 
-    // initialize partial result as this process' data
-    memcpy(partial, send_data, count);
+    ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[source]));
+}
 
-    // wait for children to enter this function
-    for (int i = 0; i < num_children; i++) {
-        MIMPI_CHECK2(MIMPI_Recv(buf, count, left + i, REDUCE_TAG), partial, buf);
-        // receive partial result from child and update this process' partial result
-        partially_reduce(partial, buf, count, op);
+// requests waiting for the peer, which has left the MPI block
+static void fail_waiting(request_queue_t* queue) {
+    while (queue->front != NULL) {
+        request_t* req = queue->front;
+        request_queue_remove(queue, req);
+        req->in_progress = false;
+        req->done = true;
+        req->ret = MIMPI_ERROR_REMOTE_FINISHED;
+        wake_request(req);
     }
+}
+
+// process 'source' is in MIMPI_Finalize and everything it sent has been read
+static void handle_exit(int source) {
+    ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[source]));
+
+    exited[source] = true;
+    fail_waiting(&rndv_pending[source]);
+    fail_waiting(&rndv_bound[source]);
+    fail_waiting(&stalled[source]);
+
+    ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[source]));
 
-    free(buf);
+    num_exited++;
+    // the posted receives will never be matched
+    wake_posted(source);
+    // sends not started yet will fail
+    activate_sends(source);
+}
 
-    if (my_world_rank != 0) {
-        // send partial result to parent
-        MIMPI_CHECK1(MIMPI_Send(partial, count, parent, REDUCE_TAG), partial);
+// the header of a message from source has arrived
+static void begin_message(int source, int tag, int count) {
+    partial_t* partial = &partials[source];
+    partial->active = true;
+    partial->tag = tag;
+    partial->count = count;
+    partial->received = 0;
+    if (trace_enabled()) {
+        partial->flow = trace_flow_id(source, my_world_rank, ++flow_arrived[source]);
+        partial->started = trace_clock();
+    }
+    // expected message goes directly to the caller's buffer
+    partial->req = take_posted_receive(source, tag, count);
+    if (partial->req != NULL) {
+        partial->data = partial->req->data;
+    }
+    else {
+        partial->data = (char*) pool_alloc(count * sizeof(char));
+    }
+}
 
-        // wait for parent to send complete result or register error
-        MIMPI_CHECK1(MIMPI_Recv(partial, count, parent, REDUCE_TAG), partial);
+// all data of the message from source has arrived
+static void end_message(int source) {
+    partial_t* partial = &partials[source];
+    partial->active = false;
+    // rendezvous data is counted with the tag it was received with
+    stats_received(source, partial->tag == RNDV_DATA_TAG ? partial->req->tag : partial->tag, partial->count);
+    trace_message(TRACE_ARRIVE, partial->started, source, partial->tag, partial->count, partial->flow);
+    if (partial->req != NULL) {
+        complete_receive(partial->req, partial->tag != RNDV_DATA_TAG);
+        return;
     }
+    if (partial->tag == RTS_TAG || partial->tag == CTS_TAG || partial->tag == CREDIT_TAG || partial->tag == DEADLOCK_TAG) {
+        if (partial->tag == RTS_TAG) handle_rts(source, (int*) partial->data);
+        else if (partial->tag == CTS_TAG) handle_cts(source, *(int*) partial->data);
+        else if (partial->tag == CREDIT_TAG) handle_credit(source, *(size_t*) partial->data);
+        else handle_probe(source, (probe_t*) partial->data);
+        pool_free(partial->data, partial->count);
+        return;
+    }
+    store_message(source, partial->tag, partial->count, partial->data);
+}
 
-    // write complete result
-    if (my_world_rank == root) {
-        memcpy(recv_data, partial, count);
+// read what has arrived of messages from source, so that the worker
+// never waits on a single sender (in case of TRANSPORT_PIPE and TRANSPORT_SHM)
+static void handle_incoming_message(int source) {
+    partial_t* partial = &partials[source];
+    if (!partial->active) {
+        // tag and count
+        char* header = (char*) partial->header;
+        partial->header_received += recv_available(source, header + partial->header_received, sizeof(partial->header) - partial->header_received);
+        if (partial->header_received < (int) sizeof(partial->header)) return;
+        partial->header_received = 0;
+
+        if (partial->header[0] == KICK_TAG) {
+            handle_kick();
+            return;
+        }
+        begin_message(source, partial->header[0], partial->header[1]);
     }
 
-    // send complete result to children or propagate error
-    for (int i = 0; i < num_children; i++) {
-        MIMPI_CHECK1(MIMPI_Send(partial, count, left + i, REDUCE_TAG), partial);
+    partial->received += recv_available(source, partial->data + partial->received, partial->count - partial->received);
+    if (partial->received == partial->count) end_message(source);
+}
+
+// read one frame from the inbound channel (in case of TRANSPORT_MUX),
+// frames are written atomically so a readable one is there as a whole
+static void handle_incoming_frame() {
+    int fd = channels.read_fds[0];
+    frame_header_t header;
+    read_full(fd, &header, sizeof(header));
+    int source = header.source;
+    assert(0 <= source && source < my_world_size);
+
+    if (header.tag == EXIT_TAG) {
+        // process 'source' is in MIMPI_Finalize and all its frames were read
+        handle_exit(source);
+        return;
+    }
+    if (header.tag == KICK_TAG) {
+        handle_kick();
+        return;
     }
 
-    free(partial);
+    // frames of one source arrive in order, so a message is reassembled in place
+    partial_t* partial = &partials[source];
+    if (!partial->active) begin_message(source, header.tag, header.count);
+    read_full(fd, partial->data + partial->received, header.length);
+    partial->received += header.length;
 
-    return MIMPI_SUCCESS;
-}
\ No newline at end of file
+    if (partial->received == partial->count) end_message(source);
+}
+
+// register read fds of incoming channels, tagged with their index
+// (write fds waiting for room are tagged with my_world_size + destination)
+static void epoll_transfer_read_init() {
+    int fd;
+    ASSERT_SYS_OK(fd = epoll_create1(EPOLL_CLOEXEC));
+    // keep the descriptor inside the range reserved for the library
+    ASSERT_SYS_OK(epoll_fd = fcntl(fd, F_DUPFD_CLOEXEC, FIRST_CHANNEL_FD));
+    ASSERT_SYS_OK(close(fd));
+
+    for (int i = 0; i < channels.num_read; i++) {
+        struct epoll_event event = { .events = EPOLLIN, .data.u32 = i };
+        ASSERT_SYS_OK(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, channels.read_fds[i], &event));
+    }
+}
+
+// true if a message (or a part of it) is already waiting in incoming channel i
+static bool channel_has_data(int i) {
+    int available;
+    ASSERT_SYS_OK(ioctl(channels.read_fds[i], FIONREAD, &available));
+    return available > 0;
+}
+
+// worker thread code for pipe-based transports, visits only channels reported ready by epoll
+static void* worker_runnable(void* arg) {
+    (void) arg;
+    trace_thread(TRACE_WORKER);
+    struct epoll_event events[EPOLL_BATCH];
+    while (num_exited < my_world_size) {
+        // epoll_wait is used with timeout set to -1, which means no timeout
+        int ready;
+        do {
+            ready = epoll_wait(epoll_fd, events, EPOLL_BATCH, -1);
+        } while (ready == -1 && errno == EINTR);
+        ASSERT_SYS_OK(ready);
+
+        for (int k = 0; k < ready; k++) {
+            int i = (int) events[k].data.u32;
+            if (i >= my_world_size) {
+                // channel my_world_rank -> i - my_world_size has room again
+                activate_sends(i - my_world_size);
+                continue;
+            }
+            handle_epoll_error(i, events[k].events);
+
+            if (events[k].events & EPOLLIN) {
+                // incoming messages, drain a bounded number so that other channels are not starved
+                int drained = 0;
+                do {
+                    if (transport == TRANSPORT_MUX) handle_incoming_frame();
+                    else handle_incoming_message(i);
+                } while (++drained < MAX_DRAIN && num_exited < my_world_size && channel_has_data(i));
+            }
+            else if (events[k].events & EPOLLHUP) {
+                // process 'i' is in MIMPI_Finalize and its channel is empty
+                ASSERT_SYS_OK(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, channels.read_fds[i], NULL));
+                handle_exit(i);
+            }
+        }
+
+        progress_active_sends();
+    }
+    return NULL;
+}
+
+// worker thread code for shared-memory transport, sleeps on this rank's doorbell
+static void* shm_worker_runnable(void* arg) {
+    (void) arg;
+    trace_thread(TRACE_WORKER);
+    while (num_exited < my_world_size) {
+        // read before scanning, so that data published during the scan wakes us up
+        unsigned seen = doorbell_seq(&segment, my_world_rank);
+        bool progress = false;
+
+        for (int i = 0; i < my_world_size; i++) {
+            if (exited[i]) continue;
+            if (ring_readable(&segment, i, my_world_rank) > 0) {
+                // incoming message
+                handle_incoming_message(i);
+                progress = true;
+            }
+            else if (ring_drained(&segment, i, my_world_rank)) {
+                // process 'i' is in MIMPI_Finalize and its ring is empty
+                handle_exit(i);
+                progress = true;
+            }
+        }
+
+        // sends blocked on a full ring stay active until the consumer rings the doorbell
+        progress_active_sends();
+
+        if (!progress && num_exited < my_world_size) doorbell_wait(&segment, my_world_rank, seen);
+    }
+    return NULL;
+}
+
+void MIMPI_Init(bool enable_deadlock_detection) {
+    detection = enable_deadlock_detection;
+    channels_init();
+    tuning_load();
+
+    my_world_rank = MIMPI_World_rank();
+    my_world_size = MIMPI_World_size();
+    transport = get_transport();
+    stats_init(my_world_rank, my_world_size);
+    trace_init(my_world_rank);
+
+    if (transport == TRANSPORT_SHM) {
+        // the mapping outlives the descriptor
+        shm_segment_attach(&segment, SHM_SEGMENT_FD);
+        ASSERT_SYS_OK(close(SHM_SEGMENT_FD));
+        assert(segment.n == my_world_size);
+    }
+    else if (transport == TRANSPORT_MUX) {
+        // a single inbound channel and the inbound channels of all processes
+        channel_table_load(&channels, 1, my_world_size);
+    }
+    else {
+        // mimpirun hands over only this process' channel ends
+        channel_table_load(&channels, my_world_size, my_world_size);
+    }
+
+    if (transport != TRANSPORT_SHM) {
+        // the worker must never wait on a single channel, blocking callers poll instead
+        for (int i = 0; i < channels.num_read; i++) {
+            set_nonblocking(channels.read_fds[i]);
+        }
+        for (int i = 0; i < channels.num_write; i++) {
+            set_nonblocking(channels.write_fds[i]);
+        }
+    }
+
+    num_exited = 0;
+
+    exited = (bool*) malloc(my_world_size * sizeof(bool));
+    buffers = (buffer_t**) malloc(my_world_size * sizeof(buffer_t*));
+    posted = (request_queue_t*) calloc(my_world_size, sizeof(request_queue_t));
+    assert(exited != NULL);
+    assert(buffers != NULL);
+    assert(posted != NULL);
+
+    partials = (partial_t*) calloc(my_world_size, sizeof(partial_t));
+    assert(partials != NULL);
+
+    sendq = (request_queue_t*) calloc(my_world_size, sizeof(request_queue_t));
+    sending = (bool*) calloc(my_world_size, sizeof(bool));
+    send_active = (bool*) calloc(my_world_size, sizeof(bool));
+    active_sends = (int*) malloc(my_world_size * sizeof(int));
+    worker_sends = (int*) malloc(my_world_size * sizeof(int));
+    assert(sendq != NULL);
+    assert(sending != NULL);
+    assert(send_active != NULL);
+    assert(active_sends != NULL);
+    assert(worker_sends != NULL);
+    num_active_sends = 0;
+    num_pending_sends = 0;
+    kick_pending = false;
+    closing = false;
+
+    const char* limit = getenv("MIMPI_EAGER_LIMIT");
+    eager_limit = limit != NULL ? strtoull(limit, NULL, 10) : DEFAULT_EAGER_LIMIT;
+    rndv_pending = (request_queue_t*) calloc(my_world_size, sizeof(request_queue_t));
+    rndv_bound = (request_queue_t*) calloc(my_world_size, sizeof(request_queue_t));
+    rndv_seq = (int*) calloc(my_world_size, sizeof(int));
+    assert(rndv_pending != NULL);
+    assert(rndv_bound != NULL);
+    assert(rndv_seq != NULL);
+
+    const char* budget = getenv("MIMPI_CREDITS");
+    credit_limit = budget != NULL ? strtoull(budget, NULL, 10) : DEFAULT_CREDITS;
+    // a smaller budget would never let the largest eager message through
+    credit_limit = MAX(credit_limit, eager_charge(MIN(eager_limit, (size_t) INT_MAX)));
+    credits = (size_t*) malloc(my_world_size * sizeof(size_t));
+    stalled = (request_queue_t*) calloc(my_world_size, sizeof(request_queue_t));
+    returned = (size_t*) calloc(my_world_size, sizeof(size_t));
+    starved = (bool*) calloc(my_world_size, sizeof(bool));
+    flow_written = (uint32_t*) calloc(my_world_size, sizeof(uint32_t));
+    flow_arrived = (uint32_t*) calloc(my_world_size, sizeof(uint32_t));
+    assert(credits != NULL);
+    assert(stalled != NULL);
+    assert(returned != NULL);
+    assert(starved != NULL);
+    assert(flow_written != NULL);
+    assert(flow_arrived != NULL);
+
+    messages_out = (uint32_t*) calloc(my_world_size, sizeof(uint32_t));
+    messages_in = (uint32_t*) calloc(my_world_size, sizeof(uint32_t));
+    blocked_on = (int*) calloc(my_world_size, sizeof(int));
+    passed = (passed_t*) calloc(my_world_size, sizeof(passed_t));
+    assert(messages_out != NULL);
+    assert(messages_in != NULL);
+    assert(blocked_on != NULL);
+    assert(passed != NULL);
+    const char* delay = getenv("MIMPI_PROBE_DELAY");
+    probe_delay = delay != NULL ? strtoull(delay, NULL, 10) : DEFAULT_PROBE_DELAY;
+    num_blocked = 0;
+    num_threads = 0;
+    ASSERT_ZERO(pthread_key_create(&thread_key, uncount_thread));
+    wait_seq = 0;
+    probe_seq = 0;
+
+    peer_mutex = (pthread_mutex_t*) malloc(my_world_size * sizeof(pthread_mutex_t));
+    assert(peer_mutex != NULL);
+
+    for (int i = 0; i < my_world_size; i++) {
+        exited[i] = false;
+        buffers[i] = buffer_create();
+        credits[i] = credit_limit;
+        ASSERT_ZERO(pthread_mutex_init(&peer_mutex[i], NULL));
+    }
+
+    // start worker thread that polls incoming channels
+    ASSERT_ZERO(pthread_mutex_init(&worker_mutex, NULL));
+    ASSERT_ZERO(pthread_cond_init(&wait_sends, NULL));
+    if (transport == TRANSPORT_SHM) {
+        ASSERT_ZERO(pthread_create(&worker, NULL, shm_worker_runnable, NULL));
+    }
+    else {
+        epoll_transfer_read_init();
+        ASSERT_ZERO(pthread_create(&worker, NULL, worker_runnable, NULL));
+    }
+}
+
+void MIMPI_Finalize() {
+    // queued sends must be written in full before channels are closed
+    ASSERT_ZERO(pthread_mutex_lock(&worker_mutex));
+    while (num_pending_sends > 0) {
+        ASSERT_ZERO(pthread_cond_wait(&wait_sends, &worker_mutex));
+    }
+    // a rendezvous send that gets CTS from now on is dropped,
+    // its receiver fails with MIMPI_ERROR_REMOTE_FINISHED once this process exits
+    closing = true;
+    ASSERT_ZERO(pthread_mutex_unlock(&worker_mutex));
+
+    // so are those still waiting for CTS or credits
+    for (int i = 0; i < my_world_size; i++) {
+        ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[i]));
+        request_queue_t* queues[2] = { &rndv_pending[i], &stalled[i] };
+        for (int j = 0; j < 2; j++) {
+            while (queues[j]->front != NULL) {
+                request_t* req = queues[j]->front;
+                request_queue_remove(queues[j], req);
+                drop_send(req);
+            }
+        }
+        ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[i]));
+    }
+
+    if (transport == TRANSPORT_SHM) {
+        // mark every one of my outgoing rings as closed (counterpart of POLLHUP)
+        for (int i = 0; i < my_world_size; i++) {
+            ring_close(&segment, my_world_rank, i);
+        }
+    }
+    else if (transport == TRANSPORT_MUX) {
+        // the inbound channels stay open for other senders, so announce the exit explicitly
+        for (int i = 0; i < my_world_size; i++) {
+            send_frame(i, EXIT_TAG, 0, NULL, 0);
+        }
+        close_my_outgoing_transfer_write_fds(&channels);
+    }
+    else {
+        // generate POLLHUP in every worker for every one of my outgoing channels
+        close_my_outgoing_transfer_write_fds(&channels);
+    }
+
+    // synchronize on all processes' MIMPI_Finalize (beacuse worker only returns when all processes have sent exit_event)
+    ASSERT_ZERO(pthread_join(worker, NULL));
+
+    if (transport == TRANSPORT_SHM) {
+        shm_segment_detach(&segment);
+    }
+    else {
+        // close channel ends that were polled by worker
+        close_my_incoming_transfer_read_fds(&channels);
+        ASSERT_SYS_OK(close(epoll_fd));
+        channel_table_destroy(&channels);
+    }
+
+    // destroy pthread variables
+    ASSERT_ZERO(pthread_mutex_destroy(&worker_mutex));
+    ASSERT_ZERO(pthread_cond_destroy(&wait_sends));
+    for (int i = 0; i < my_world_size; i++) {
+        ASSERT_ZERO(pthread_mutex_destroy(&peer_mutex[i]));
+    }
+
+    // fprintf(stderr, "rank %d\n", my_world_rank);
+    for (int i = 0; i < my_world_size; i++) {
+        buffer_destroy(buffers[i]);
+    }
+
+    free(exited);
+    free(buffers);
+    free(posted);
+    free(partials);
+    free(sendq);
+    free(sending);
+    free(send_active);
+    free(active_sends);
+    free(worker_sends);
+    stats_finalize();
+    trace_finalize();
+
+    free(rndv_pending);
+    free(rndv_bound);
+    free(rndv_seq);
+    free(credits);
+    free(stalled);
+    free(returned);
+    free(starved);
+    free(flow_written);
+    free(flow_arrived);
+    free(messages_out);
+    free(messages_in);
+    free(blocked_on);
+    free(passed);
+    ASSERT_ZERO(pthread_key_delete(thread_key));
+    free(peer_mutex);
+
+    pool_release();
+    tuning_release();
+
+    channels_finalize();
+}
+
+int MIMPI_World_size() {
+    return atoi(getenv("MIMPI_WORLD_SIZE"));
+}
+
+int MIMPI_World_rank() {
+    return atoi(getenv("MIMPI_WORLD_RANK"));
+}
+
+// true once the request has completed, its outcome is then in req->ret
+// (assumes locked peer_mutex[req->peer])
+static bool update_request(request_t* req) {
+    if (req->done) return true;
+
+    // a receive already being filled must finish before data may be handed back
+    if (req->kind == REQUEST_RECV && !req->in_progress && exited[req->peer]) {
+        fail_receive(req, MIMPI_ERROR_REMOTE_FINISHED);
+    }
+    return req->done;
+}
+
+// check req without blocking, or make it wake the calling thread up once it progresses
+static bool update_or_watch(request_t* req) {
+    ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[req->peer]));
+
+    bool done = update_request(req);
+    if (!done) req->waiter = &this_thread;
+
+    ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[req->peer]));
+
+    return done;
+}
+
+static void unwatch(request_t* req) {
+    ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[req->peer]));
+
+    if (req->waiter == &this_thread) req->waiter = NULL;
+
+    ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[req->peer]));
+}
+
+// true while only the peer can complete the request: a receive not matched yet, or a send
+// waiting for CTS or credits (assumes locked peer_mutex[req->peer])
+static bool awaits_peer(request_t* req) {
+    if (req->kind == REQUEST_RECV) return !update_request(req);
+
+    return queued_in(&rndv_pending[req->peer], req) || queued_in(&stalled[req->peer], req);
+}
+
+// the calling thread sleeps until the peer acts on the request, which makes it an edge of
+// the wait-for graph
+static void block_wait(request_t* req) {
+    if (!single_threaded()) return;
+
+    ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[req->peer]));
+
+    bool blocked = awaits_peer(req);
+    if (blocked) {
+        req->wait = __atomic_add_fetch(&wait_seq, 1, __ATOMIC_RELAXED);
+        blocked_on[req->peer]++;
+        __atomic_fetch_add(&num_blocked, 1, __ATOMIC_RELAXED);
+        start_probe(req);
+    }
+
+    ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[req->peer]));
+
+    if (blocked) kick_worker();
+}
+
+static void unblock_wait(request_t* req) {
+    if (req->wait == 0) return;
+
+    ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[req->peer]));
+
+    req->wait = 0;
+    blocked_on[req->peer]--;
+    __atomic_fetch_sub(&num_blocked, 1, __ATOMIC_RELAXED);
+
+    ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[req->peer]));
+}
+
+// a thread sleeping on a request, deadlock detection probes for it only once it has stalled,
+// so that requests finishing quickly cost no control traffic
+typedef struct Stall {
+    request_t* req;           // NULL if deadlock detection does not cover the wait
+    bool probed;
+    struct timespec deadline; // CLOCK_REALTIME, the clock of waiter conditions
+} stall_t;
+
+static void stall_start(stall_t* stall, request_t* req) {
+    stall->req = detection ? req : NULL;
+    stall->probed = false;
+    if (stall->req == NULL || probe_delay == 0) return;
+
+    ASSERT_SYS_OK(clock_gettime(CLOCK_REALTIME, &stall->deadline));
+    uint64_t ns = stall->deadline.tv_nsec + probe_delay * 1000;
+    stall->deadline.tv_sec += ns / 1000000000;
+    stall->deadline.tv_nsec = ns % 1000000000;
+}
+
+// sleep until woken up after 'seen' was read, or until the request has stalled
+static void stall_sleep(stall_t* stall, unsigned seen) {
+    if (stall->req == NULL || stall->probed) {
+        waiter_wait(&this_thread, seen);
+        return;
+    }
+    if (probe_delay == 0 || !waiter_wait_until(&this_thread, seen, &stall->deadline)) {
+        stall->probed = true;
+        block_wait(stall->req);
+    }
+}
+
+static void stall_end(stall_t* stall) {
+    if (stall->req != NULL) unblock_wait(stall->req);
+}
+
+static void wait_request(request_t* req) {
+    uint64_t start = 0;
+    bool slept = false;
+    stall_t stall;
+    while (true) {
+        // read before checking, so that a wakeup in between is not lost
+        unsigned seen = waiter_seq(&this_thread);
+        if (update_or_watch(req)) break;
+        if (!slept) {
+            slept = true;
+            start = stats_clock();
+            stall_start(&stall, req);
+        }
+        stall_sleep(&stall, seen);
+    }
+    if (slept) stall_end(&stall);
+    // only waits that slept are recorded
+    if (start != 0) stats_wait(req->peer, req->tag, start);
+}
+
+// the caller writes the message itself if nothing is queued before it,
+// otherwise (or what a non-blocking write left of it) is queued for the worker
+static MIMPI_Retcode start_send(request_t* req, void const* data, int count, int destination, int tag, bool blocking) {
+    count_thread();
+    *req = (request_t) {
+        .kind = REQUEST_SEND, .peer = destination, .tag = tag, .count = count, .data = (char*) data,
+        .sent = 0, .in_progress = false, .done = false, .blocking = blocking, .detached = false,
+        .ret = MIMPI_SUCCESS, .waiter = NULL, .next = NULL,
+    };
+
+    ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[destination]));
+
+    if (exited[destination]) {
+        ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[destination]));
+        return MIMPI_ERROR_REMOTE_FINISHED;
+    }
+    stats_sent(destination, tag, count);
+
+    bool eager = (size_t) count <= eager_limit;
+    if (stalled[destination].front != NULL || (eager && eager_charge(count) > credits[destination])) {
+        // the receiver has too much queued from this process already, the send waits until
+        // it consumes some, and so do the sends after it to keep the order of messages
+        stats_credit_stall(destination);
+        bool first = stalled[destination].front == NULL;
+        request_queue_add(&stalled[destination], req);
+        if (first) release_stalled(destination);
+
+        ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[destination]));
+
+        if (first) kick_worker();
+        return MIMPI_SUCCESS;
+    }
+
+    if (!eager) {
+        start_rendezvous(req);
+
+        ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[destination]));
+
+        kick_worker();
+        return MIMPI_SUCCESS;
+    }
+    messages_out[destination]++;
+    credits[destination] -= eager_charge(count);
+
+    bool kick = false;
+    if (sendq[destination].front == NULL && !sending[destination]) {
+        sending[destination] = true;
+        req->in_progress = true;
+        trace_write_start(req);
+
+        ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[destination]));
+
+        bool finished = true;
+        if (blocking) send_message(destination, tag, count, data);
+        else finished = try_send(req);
+
+        ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[destination]));
+
+        sending[destination] = false;
+        if (finished) {
+            trace_write_end(req);
+            req->in_progress = false;
+            req->done = true;
+            // sends queued meanwhile by other threads were skipped by the worker
+            kick = sendq[destination].front != NULL;
+        }
+    }
+
+    if (!req->done) {
+        request_queue_add(&sendq[destination], req);
+
+        ASSERT_ZERO(pthread_mutex_lock(&worker_mutex));
+        num_pending_sends++;
+        ASSERT_ZERO(pthread_mutex_unlock(&worker_mutex));
+
+        kick = true;
+    }
+
+    if (kick) activate_sends(destination);
+
+    ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[destination]));
+
+    if (kick) kick_worker();
+
+    return MIMPI_SUCCESS;
+}
+
+// copy a buffered message or post the receive, so that the worker
+// reads the message straight into data (assumes locked peer_mutex[source]);
+// true if the worker has to be kicked to send a control message
+static bool start_recv(request_t* req, void* data, int count, int source, int tag, bool blocking) {
+    count_thread();
+    *req = (request_t) {
+        .kind = REQUEST_RECV, .peer = source, .tag = tag, .count = count, .data = (char*) data,
+        .sent = 0, .in_progress = false, .done = false, .blocking = blocking, .detached = false,
+        .ret = MIMPI_SUCCESS, .waiter = NULL, .next = NULL,
+    };
+
+    int seq;
+    char* match_data = extract_matching_data(buffers[source], tag, count, &seq);
+    if (match_data != NULL) {
+        // unexpected message was already buffered
+        memcpy(data, match_data, count);
+        pool_free(match_data, count);
+        req->done = true;
+        stats_buffered(source, -1);
+        return return_credits(source, count);
+    }
+
+    if (seq != -1) {
+        // rendezvous send announced earlier
+        stats_buffered(source, -1);
+        if (exited[source]) {
+            req->done = true;
+            req->ret = MIMPI_ERROR_REMOTE_FINISHED;
+            return false;
+        }
+        bind_receive(req, seq);
+        return true;
+    }
+
+    request_queue_add(&posted[source], req);
+    return false;
+}
+
+static MIMPI_Retcode release_request(MIMPI_Request* request) {
+    MIMPI_Retcode ret = (*request)->ret;
+    pool_free(*request, sizeof(request_t));
+    *request = MIMPI_REQUEST_NULL;
+    return ret;
+}
+
+static MIMPI_Retcode send_blocking(void const* data, int count, int destination, int tag) {
+    // check for errors
+    if (destination == my_world_rank) {
+        return MIMPI_ERROR_ATTEMPTED_SELF_OP;
+    }
+    if (destination < 0 || destination >= my_world_size) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+
+    request_t req;
+    MIMPI_CHECK(start_send(&req, data, count, destination, tag, true));
+    wait_request(&req);
+    return req.ret;
+}
+
+static MIMPI_Retcode recv_blocking(void* data, int count, int source, int tag) {
+    // check for errors
+    if (source == my_world_rank) {
+        return MIMPI_ERROR_ATTEMPTED_SELF_OP;
+    }
+    if (source < 0 || source >= my_world_size) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+
+    ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[source]));
+
+    request_t req;
+    bool kick = start_recv(&req, data, count, source, tag, true);
+
+    ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[source]));
+
+    if (kick) kick_worker();
+
+    wait_request(&req);
+
+    return req.ret;
+}
+
+MIMPI_Retcode MIMPI_Send(void const* data, int count, int destination, int tag) {
+    trace_begin(TRACE_SEND, destination, tag, count);
+    MIMPI_Retcode ret = send_blocking(data, count, destination, tag);
+    trace_end(TRACE_SEND);
+    return ret;
+}
+
+MIMPI_Retcode MIMPI_Recv(void* data, int count, int source, int tag) {
+    trace_begin(TRACE_RECV, source, tag, count);
+    MIMPI_Retcode ret = recv_blocking(data, count, source, tag);
+    trace_end(TRACE_RECV);
+    return ret;
+}
+
+MIMPI_Retcode MIMPI_Isend(void const* data, int count, int destination, int tag, MIMPI_Request* request) {
+    *request = MIMPI_REQUEST_NULL;
+
+    // check for errors
+    if (destination == my_world_rank) {
+        return MIMPI_ERROR_ATTEMPTED_SELF_OP;
+    }
+    if (destination < 0 || destination >= my_world_size) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+
+    request_t* req = (request_t*) pool_alloc(sizeof(request_t));
+
+    MIMPI_Retcode ret = start_send(req, data, count, destination, tag, false);
+    if (ret != MIMPI_SUCCESS) {
+        pool_free(req, sizeof(request_t));
+        return ret;
+    }
+
+    *request = req;
+    return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Irecv(void* data, int count, int source, int tag, MIMPI_Request* request) {
+    *request = MIMPI_REQUEST_NULL;
+
+    // check for errors
+    if (source == my_world_rank) {
+        return MIMPI_ERROR_ATTEMPTED_SELF_OP;
+    }
+    if (source < 0 || source >= my_world_size) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+
+    request_t* req = (request_t*) pool_alloc(sizeof(request_t));
+
+    ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[source]));
+
+    bool kick = start_recv(req, data, count, source, tag, false);
+
+    ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[source]));
+
+    if (kick) kick_worker();
+
+    *request = req;
+    return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Wait(MIMPI_Request* request) {
+    if (*request == MIMPI_REQUEST_NULL) return MIMPI_SUCCESS;
+
+    wait_request(*request);
+
+    return release_request(request);
+}
+
+MIMPI_Retcode MIMPI_Test(MIMPI_Request* request, bool* flag) {
+    *flag = true;
+    if (*request == MIMPI_REQUEST_NULL) return MIMPI_SUCCESS;
+
+    request_t* req = *request;
+    ASSERT_ZERO(pthread_mutex_lock(&peer_mutex[req->peer]));
+
+    *flag = update_request(req);
+
+    ASSERT_ZERO(pthread_mutex_unlock(&peer_mutex[req->peer]));
+
+    if (!*flag) return MIMPI_SUCCESS;
+    return release_request(request);
+}
+
+MIMPI_Retcode MIMPI_Waitall(int count, MIMPI_Request* requests) {
+    MIMPI_Retcode ret = MIMPI_SUCCESS;
+    for (int i = 0; i < count; i++) {
+        MIMPI_Retcode r = MIMPI_Wait(&requests[i]);
+        if (ret == MIMPI_SUCCESS) ret = r;
+    }
+    return ret;
+}
+
+MIMPI_Retcode MIMPI_Waitany(int count, MIMPI_Request* requests, int* index) {
+    *index = -1;
+
+    uint64_t start = 0;
+    bool slept = false;
+    stall_t stall;
+    while (true) {
+        unsigned seen = waiter_seq(&this_thread);
+        int pending = 0;
+        request_t* last = NULL;
+        for (int i = 0; i < count && *index == -1; i++) {
+            if (requests[i] == MIMPI_REQUEST_NULL) continue;
+            pending++;
+            last = requests[i];
+            if (update_or_watch(requests[i])) *index = i;
+        }
+        if (pending == 0 || *index != -1) break;
+        if (!slept) {
+            slept = true;
+            start = stats_clock();
+            // waiting for any of several requests is not covered by deadlock detection
+            stall_start(&stall, pending == 1 ? last : NULL);
+        }
+        stall_sleep(&stall, seen);
+    }
+    if (slept) stall_end(&stall);
+    if (start != 0 && *index != -1) stats_wait(requests[*index]->peer, requests[*index]->tag, start);
+
+    // the other requests may outlive this thread
+    for (int i = 0; i < count; i++) {
+        if (requests[i] != MIMPI_REQUEST_NULL && i != *index) unwatch(requests[i]);
+    }
+
+    if (*index == -1) return MIMPI_SUCCESS;
+    return release_request(&requests[*index]);
+}
+
+// send to one peer while receiving from another, the first error is returned
+static MIMPI_Retcode exchange(const void* send_data, int send_count, int destination,
+                              void* recv_data, int recv_count, int source, int tag) {
+    MIMPI_Request request;
+    MIMPI_CHECK(MIMPI_Isend(send_data, send_count, destination, tag, &request));
+    MIMPI_Retcode ret = MIMPI_Recv(recv_data, recv_count, source, tag);
+    MIMPI_Retcode wait_ret = MIMPI_Wait(&request);
+    return ret != MIMPI_SUCCESS ? ret : wait_ret;
+}
+
+static MIMPI_Retcode barrier() {
+    char buf;
+
+    // in every round a process notifies the one 2^k ahead of it and waits for the one 2^k behind,
+    // after ceil(log2 n) rounds each has heard (transitively) from all others
+    for (int distance = 1; distance < my_world_size; distance *= 2) {
+        int to = (my_world_rank + distance) % my_world_size;
+        int from = (my_world_rank - distance + my_world_size) % my_world_size;
+
+        // a process that left (or failed the barrier and left) makes its neighbours fail, and so on
+        trace_begin(TRACE_ROUND, from, BARRIER_TAG, 1);
+        MIMPI_Retcode ret = exchange(&(char) {BARRIER_WAIT}, 1, to, &buf, 1, from, BARRIER_TAG);
+        trace_end(TRACE_ROUND);
+        if (ret != MIMPI_SUCCESS) return ret;
+        assert(buf == BARRIER_WAIT);
+    }
+
+    return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Barrier() {
+    trace_begin(TRACE_BARRIER, -1, BARRIER_TAG, 0);
+    uint64_t start = stats_clock();
+    MIMPI_Retcode ret = barrier();
+    stats_collective(BARRIER_TAG, start);
+    trace_end(TRACE_BARRIER);
+    return ret;
+}
+
+// rank relative to root, so that trees of every root have the same shape
+static int relative_rank_of(int rank, int root) {
+    return (rank - root + my_world_size) % my_world_size;
+}
+
+static int relative_rank(int root) {
+    return relative_rank_of(my_world_rank, root);
+}
+
+static int absolute_rank(int relative, int root) {
+    return (relative + root) % my_world_size;
+}
+
+// in the binomial tree rooted at root the parent of relative rank v is v with its lowest
+// set bit cleared, and its children are v + 2^k for every 2^k below that bit
+static int binomial_parent(int root) {
+    int v = relative_rank(root);
+    return absolute_rank(v & (v - 1), root);
+}
+
+// number of processes in the binomial subtree of relative rank v, which are v, v + 1, ...
+static int subtree_size(int v) {
+    int lowest = v == 0 ? my_world_size : (v & -v);
+    return MIN(lowest, my_world_size - v);
+}
+
+// children in order of decreasing subtree size, returns their number
+static int binomial_children(int root, int* children) {
+    int v = relative_rank(root);
+    int mask = 1;
+    while (mask < my_world_size && (v & mask) == 0) mask <<= 1;
+
+    int num = 0;
+    for (mask >>= 1; mask > 0; mask >>= 1) {
+        if (v + mask < my_world_size) children[num++] = absolute_rank(v + mask, root);
+    }
+    return num;
+}
+
+// send data to all peers at once and wait until it is written, the first error is returned
+static MIMPI_Retcode send_to_all(const void* data, int count, const int* peers, int num, int tag) {
+    MIMPI_Request requests[MAX_TREE_CHILDREN];
+    MIMPI_Retcode ret = MIMPI_SUCCESS;
+    for (int i = 0; i < num; i++) {
+        requests[i] = MIMPI_REQUEST_NULL;
+        if (ret == MIMPI_SUCCESS) ret = MIMPI_Isend(data, count, peers[i], tag, &requests[i]);
+    }
+
+    MIMPI_Retcode wait_ret = MIMPI_Waitall(num, requests);
+    return ret != MIMPI_SUCCESS ? ret : wait_ret;
+}
+
+// data goes down the chain root, root + 1, ... in segments, a rank passes a segment on
+// while it receives the next one
+static MIMPI_Retcode bcast_chain(void* data, int count, int root) {
+    int v = relative_rank(root);
+    int prev = absolute_rank(v - 1, root);
+    int next = absolute_rank(v + 1, root);
+    bool last = v == my_world_size - 1;
+
+    MIMPI_Request window[BCAST_WINDOW];
+    for (int i = 0; i < BCAST_WINDOW; i++) {
+        window[i] = MIMPI_REQUEST_NULL;
+    }
+
+    MIMPI_Retcode ret = MIMPI_SUCCESS;
+    for (int offset = 0, s = 0; offset < count && ret == MIMPI_SUCCESS; offset += BCAST_SEGMENT_SIZE, s++) {
+        char* segment = (char*) data + offset;
+        int length = MIN(count - offset, BCAST_SEGMENT_SIZE);
+
+        if (v != 0) ret = MIMPI_Recv(segment, length, prev, BCAST_TAG);
+        if (ret == MIMPI_SUCCESS && !last) {
+            MIMPI_Request* request = &window[s % BCAST_WINDOW];
+            ret = MIMPI_Wait(request);
+            if (ret == MIMPI_SUCCESS) ret = MIMPI_Isend(segment, length, next, BCAST_TAG, request);
+        }
+    }
+
+    MIMPI_Retcode wait_ret = MIMPI_Waitall(BCAST_WINDOW, window);
+    return ret != MIMPI_SUCCESS ? ret : wait_ret;
+}
+
+// wait for the subtree to enter MIMPI_Bcast, so that data leaves the root
+// only once every process has (a one-byte notification goes up the binomial tree)
+static MIMPI_Retcode bcast_ready(const int* children, int num, int root) {
+    char buf;
+    for (int i = 0; i < num; i++) {
+        MIMPI_CHECK(MIMPI_Recv(&buf, 1, children[i], BCAST_TAG));
+        assert(buf == BCAST_READY);
+    }
+    if (my_world_rank != root) {
+        MIMPI_CHECK(MIMPI_Send(&(char) {BCAST_READY}, 1, binomial_parent(root), BCAST_TAG));
+    }
+    return MIMPI_SUCCESS;
+}
+
+// data goes down the same binomial tree
+static MIMPI_Retcode bcast_binomial(void* data, int count, int root, const int* children, int num) {
+    // wait for the parent to send bcast data or register error
+    if (my_world_rank != root) {
+        MIMPI_CHECK(MIMPI_Recv(data, count, binomial_parent(root), BCAST_TAG));
+    }
+
+    // send bcast data to children or propagate error, largest subtrees first
+    return send_to_all(data, count, children, num, BCAST_TAG);
+}
+
+static MIMPI_Retcode bcast(void* data, int count, int root) {
+    // check error
+    if (root < 0 || root >= my_world_size) return MIMPI_ERROR_NO_SUCH_RANK;
+
+    int children[MAX_TREE_CHILDREN];
+    int num = binomial_children(root, children);
+
+    trace_begin(TRACE_READY, root, BCAST_TAG, 1);
+    MIMPI_Retcode ret = bcast_ready(children, num, root);
+    trace_end(TRACE_READY);
+    if (ret != MIMPI_SUCCESS) return ret;
+
+    trace_begin(TRACE_DATA, root, BCAST_TAG, count);
+    if (tuning_select(COLL_BCAST, my_world_size, count) == BCAST_CHAIN) ret = bcast_chain(data, count, root);
+    else ret = bcast_binomial(data, count, root, children, num);
+    trace_end(TRACE_DATA);
+    return ret;
+}
+
+MIMPI_Retcode MIMPI_Bcast(void* data, int count, int root) {
+    trace_begin(TRACE_BCAST, root, BCAST_TAG, count);
+    uint64_t start = stats_clock();
+    MIMPI_Retcode ret = bcast(data, count, root);
+    stats_collective(BCAST_TAG, start);
+    trace_end(TRACE_BCAST);
+    return ret;
+}
+
+// post receives of segment s from every child, into its half of the slots
+static MIMPI_Retcode post_reduce_segment(u_int8_t* slots, MIMPI_Request* requests, int s, size_t size,
+                                         const int* children, int num) {
+    size_t offset = (size_t) s * REDUCE_SEGMENT_SIZE;
+    int length = MIN(size - offset, REDUCE_SEGMENT_SIZE);
+    for (int i = 0; i < num; i++) {
+        int slot = (s % 2) * num + i;
+        MIMPI_CHECK(MIMPI_Irecv(slots + (size_t) slot * REDUCE_SEGMENT_SIZE, length, children[i], REDUCE_TAG, &requests[slot]));
+    }
+    return MIMPI_SUCCESS;
+}
+
+static MIMPI_Retcode reduce(void const* send_data, void* recv_data, int count, MIMPI_Datatype datatype, MIMPI_Op op, int root) {
+    // check error
+    if (root < 0 || root >= my_world_size) return MIMPI_ERROR_NO_SUCH_RANK;
+    if (!reduction_valid(datatype, op)) return MIMPI_ERROR_INVALID_ARGUMENT;
+
+    int children[MAX_TREE_CHILDREN];
+    int num = binomial_children(root, children);
+    // segments hold whole elements, since the segment size is a multiple of every datatype's size
+    size_t element_size = datatype_size(datatype);
+    size_t size = (size_t) count * element_size;
+    int num_segments = size == 0 ? 1 : (size + REDUCE_SEGMENT_SIZE - 1) / REDUCE_SEGMENT_SIZE;
+
+    // scratch memory of the previous collective is reused
+    scratch_reset();
+    // the root accumulates the result in place
+    u_int8_t* partial = my_world_rank == root ? (u_int8_t*) recv_data : (u_int8_t*) scratch_alloc(size);
+    // two segment slots per child, segment s is combined while s + 1 arrives
+    u_int8_t* slots = (u_int8_t*) scratch_alloc(2 * num * REDUCE_SEGMENT_SIZE * sizeof(u_int8_t));
+
+    // initialize partial result as this process' data
+    if (partial != send_data) memcpy(partial, send_data, size);
+
+    MIMPI_Request receives[2 * MAX_TREE_CHILDREN];
+    MIMPI_Request sends[REDUCE_WINDOW];
+    for (int i = 0; i < 2 * num; i++) {
+        receives[i] = MIMPI_REQUEST_NULL;
+    }
+    for (int i = 0; i < REDUCE_WINDOW; i++) {
+        sends[i] = MIMPI_REQUEST_NULL;
+    }
+
+    MIMPI_Retcode ret = post_reduce_segment(slots, receives, 0, size, children, num);
+    for (int s = 0; s < num_segments && ret == MIMPI_SUCCESS; s++) {
+        size_t offset = (size_t) s * REDUCE_SEGMENT_SIZE;
+        int length = MIN(size - offset, REDUCE_SEGMENT_SIZE);
+
+        if (s + 1 < num_segments) ret = post_reduce_segment(slots, receives, s + 1, size, children, num);
+
+        // update this process' partial result with the children's in the order they arrive
+        for (int k = 0; k < num && ret == MIMPI_SUCCESS; k++) {
+            int i;
+            ret = MIMPI_Waitany(num, &receives[(s % 2) * num], &i);
+            if (ret != MIMPI_SUCCESS) break;
+            int slot = (s % 2) * num + i;
+            partially_reduce(partial + offset, slots + (size_t) slot * REDUCE_SEGMENT_SIZE, length / element_size, datatype, op);
+        }
+
+        // send the segment of the partial result to the parent
+        if (ret == MIMPI_SUCCESS && my_world_rank != root) {
+            MIMPI_Request* request = &sends[s % REDUCE_WINDOW];
+            ret = MIMPI_Wait(request);
+            if (ret == MIMPI_SUCCESS) ret = MIMPI_Isend(partial + offset, length, binomial_parent(root), REDUCE_TAG, request);
+        }
+    }
+
+    // receives posted before an error must not outlive the scratch memory
+    MIMPI_Retcode wait_ret = MIMPI_Waitall(2 * num, receives);
+    if (ret == MIMPI_SUCCESS) ret = wait_ret;
+    wait_ret = MIMPI_Waitall(REDUCE_WINDOW, sends);
+    return ret != MIMPI_SUCCESS ? ret : wait_ret;
+}
+
+MIMPI_Retcode MIMPI_Reduce(void const* send_data, void* recv_data, int count, MIMPI_Datatype datatype, MIMPI_Op op, int root) {
+    trace_begin(TRACE_REDUCE, root, REDUCE_TAG, count);
+    uint64_t start = stats_clock();
+    MIMPI_Retcode ret = reduce(send_data, recv_data, count, datatype, op, root);
+    stats_collective(REDUCE_TAG, start);
+    trace_end(TRACE_REDUCE);
+    return ret;
+}
+
+// partners exchange whole buffers at distances 1, 2, 4, ..., processes above the
+// largest power of two first hand their data to a partner below it and get the result back
+static MIMPI_Retcode allreduce_doubling(void* data, int count, MIMPI_Datatype datatype, MIMPI_Op op) {
+    size_t size = (size_t) count * datatype_size(datatype);
+    u_int8_t* buf = (u_int8_t*) scratch_alloc(size);
+
+    int pow2 = 1;
+    while (2 * pow2 <= my_world_size) pow2 *= 2;
+
+    if (my_world_rank >= pow2) {
+        MIMPI_CHECK(MIMPI_Send(data, size, my_world_rank - pow2, ALLREDUCE_TAG));
+        return MIMPI_Recv(data, size, my_world_rank - pow2, ALLREDUCE_TAG);
+    }
+    if (my_world_rank + pow2 < my_world_size) {
+        MIMPI_CHECK(MIMPI_Recv(buf, size, my_world_rank + pow2, ALLREDUCE_TAG));
+        partially_reduce(data, buf, count, datatype, op);
+    }
+
+    for (int mask = 1; mask < pow2; mask <<= 1) {
+        int partner = my_world_rank ^ mask;
+        MIMPI_CHECK(exchange(data, size, partner, buf, size, partner, ALLREDUCE_TAG));
+        partially_reduce(data, buf, count, datatype, op);
+    }
+
+    if (my_world_rank + pow2 < my_world_size) {
+        MIMPI_CHECK(MIMPI_Send(data, size, my_world_rank + pow2, ALLREDUCE_TAG));
+    }
+    return MIMPI_SUCCESS;
+}
+
+// the buffer is split into one chunk per process; in n - 1 steps around the ring every
+// process reduces one chunk in full (reduce-scatter), in n - 1 more the chunks go round
+// to everybody (allgather), so each process sends and receives about twice the buffer
+static MIMPI_Retcode allreduce_ring(void* data, int count, MIMPI_Datatype datatype, MIMPI_Op op) {
+    int n = my_world_size;
+    int next = (my_world_rank + 1) % n;
+    int prev = (my_world_rank + n - 1) % n;
+    size_t element_size = datatype_size(datatype);
+    u_int8_t* bytes = (u_int8_t*) data;
+
+    // chunk i starts at element first[i], the first count % n chunks are one element longer
+    int* first = (int*) scratch_alloc((n + 1) * sizeof(int));
+    for (int i = 0; i <= n; i++) {
+        first[i] = i * (count / n) + MIN(i, count % n);
+    }
+    u_int8_t* buf = (u_int8_t*) scratch_alloc((size_t) (first[1] - first[0]) * element_size);
+
+    MIMPI_Retcode ret = MIMPI_SUCCESS;
+    trace_begin(TRACE_REDUCE_SCATTER, prev, ALLREDUCE_TAG, count);
+    for (int k = 0; k < n - 1 && ret == MIMPI_SUCCESS; k++) {
+        int send_chunk = (my_world_rank - k + n) % n;
+        int recv_chunk = (my_world_rank - k - 1 + n) % n;
+        int send_count = first[send_chunk + 1] - first[send_chunk];
+        int recv_count = first[recv_chunk + 1] - first[recv_chunk];
+        ret = exchange(bytes + first[send_chunk] * element_size, send_count * element_size, next,
+                       buf, recv_count * element_size, prev, ALLREDUCE_TAG);
+        if (ret == MIMPI_SUCCESS) partially_reduce(bytes + first[recv_chunk] * element_size, buf, recv_count, datatype, op);
+    }
+    trace_end(TRACE_REDUCE_SCATTER);
+    if (ret != MIMPI_SUCCESS) return ret;
+
+    trace_begin(TRACE_SHARE, prev, ALLREDUCE_TAG, count);
+    for (int k = 0; k < n - 1 && ret == MIMPI_SUCCESS; k++) {
+        int send_chunk = (my_world_rank - k + 1 + n) % n;
+        int recv_chunk = (my_world_rank - k + n) % n;
+        int send_count = first[send_chunk + 1] - first[send_chunk];
+        int recv_count = first[recv_chunk + 1] - first[recv_chunk];
+        ret = exchange(bytes + first[send_chunk] * element_size, send_count * element_size, next,
+                       bytes + first[recv_chunk] * element_size, recv_count * element_size, prev, ALLREDUCE_TAG);
+    }
+    trace_end(TRACE_SHARE);
+    return ret;
+}
+
+static MIMPI_Retcode allreduce(void const* send_data, void* recv_data, int count, MIMPI_Datatype datatype, MIMPI_Op op) {
+    // check error
+    if (!reduction_valid(datatype, op)) return MIMPI_ERROR_INVALID_ARGUMENT;
+
+    // scratch memory of the previous collective is reused
+    scratch_reset();
+
+    // the result is accumulated in place
+    size_t size = (size_t) count * datatype_size(datatype);
+    if (recv_data != send_data) memcpy(recv_data, send_data, size);
+    if (my_world_size == 1) return MIMPI_SUCCESS;
+
+    // the ring needs at least one element per process
+    if (tuning_select(COLL_ALLREDUCE, my_world_size, size) == ALLREDUCE_RING && count >= my_world_size) {
+        return allreduce_ring(recv_data, count, datatype, op);
+    }
+    return allreduce_doubling(recv_data, count, datatype, op);
+}
+
+MIMPI_Retcode MIMPI_Allreduce(void const* send_data, void* recv_data, int count, MIMPI_Datatype datatype, MIMPI_Op op) {
+    trace_begin(TRACE_ALLREDUCE, -1, ALLREDUCE_TAG, count);
+    uint64_t start = stats_clock();
+    MIMPI_Retcode ret = allreduce(send_data, recv_data, count, datatype, op);
+    stats_collective(ALLREDUCE_TAG, start);
+    trace_end(TRACE_ALLREDUCE);
+    return ret;
+}
+
+// blocks of n processes in order of rank relative to root, or back
+static void rotate_blocks(char* to, const char* from, int count, int shift) {
+    size_t head = (size_t) (my_world_size - shift) * count;
+    memcpy(to, from + (size_t) shift * count, head);
+    memcpy(to + head, from, (size_t) shift * count);
+}
+
+// the root receives from every process at once, straight into recv_data
+static MIMPI_Retcode gather_linear(void const* send_data, void* recv_data, int count, int root) {
+    if (my_world_rank != root) return MIMPI_Send(send_data, count, root, GATHER_TAG);
+
+    char* blocks = (char*) recv_data;
+    char* own = blocks + (size_t) root * count;
+    if (own != send_data) memcpy(own, send_data, count);
+
+    MIMPI_Request* requests = (MIMPI_Request*) scratch_alloc(my_world_size * sizeof(MIMPI_Request));
+    MIMPI_Retcode ret = MIMPI_SUCCESS;
+    for (int i = 0; i < my_world_size; i++) {
+        requests[i] = MIMPI_REQUEST_NULL;
+        if (i != root && ret == MIMPI_SUCCESS) {
+            ret = MIMPI_Irecv(blocks + (size_t) i * count, count, i, GATHER_TAG, &requests[i]);
+        }
+    }
+    MIMPI_Retcode wait_ret = MIMPI_Waitall(my_world_size, requests);
+    return ret != MIMPI_SUCCESS ? ret : wait_ret;
+}
+
+static MIMPI_Retcode gather_binomial(void const* send_data, void* recv_data, int count, int root) {
+    // every process collects the blocks of its binomial subtree in relative rank order,
+    // its own first, and passes them on to its parent in one message
+    int v = relative_rank(root);
+    int size = subtree_size(v);
+    char* buf = v == 0 && root == 0 ? (char*) recv_data : (char*) scratch_alloc((size_t) size * count);
+    if (buf != send_data) memcpy(buf, send_data, count);
+
+    int children[MAX_TREE_CHILDREN];
+    int num = binomial_children(root, children);
+    MIMPI_Request requests[MAX_TREE_CHILDREN];
+    MIMPI_Retcode ret = MIMPI_SUCCESS;
+    for (int i = 0; i < num; i++) {
+        int c = relative_rank_of(children[i], root);
+        requests[i] = MIMPI_REQUEST_NULL;
+        if (ret == MIMPI_SUCCESS) {
+            ret = MIMPI_Irecv(buf + (size_t) (c - v) * count, subtree_size(c) * count, children[i], GATHER_TAG, &requests[i]);
+        }
+    }
+    MIMPI_Retcode wait_ret = MIMPI_Waitall(num, requests);
+    if (ret != MIMPI_SUCCESS) return ret;
+    MIMPI_CHECK(wait_ret);
+
+    if (v != 0) return MIMPI_Send(buf, size * count, binomial_parent(root), GATHER_TAG);
+
+    if (buf != recv_data) rotate_blocks(recv_data, buf, count, my_world_size - root);
+    return MIMPI_SUCCESS;
+}
+
+static MIMPI_Retcode gather(void const* send_data, void* recv_data, int count, int root) {
+    // check error
+    if (root < 0 || root >= my_world_size) return MIMPI_ERROR_NO_SUCH_RANK;
+
+    // scratch memory of the previous collective is reused
+    scratch_reset();
+
+    if (tuning_select(COLL_GATHER, my_world_size, count) == GATHER_LINEAR) {
+        return gather_linear(send_data, recv_data, count, root);
+    }
+    return gather_binomial(send_data, recv_data, count, root);
+}
+
+MIMPI_Retcode MIMPI_Gather(void const* send_data, void* recv_data, int count, int root) {
+    trace_begin(TRACE_GATHER, root, GATHER_TAG, count);
+    uint64_t start = stats_clock();
+    MIMPI_Retcode ret = gather(send_data, recv_data, count, root);
+    stats_collective(GATHER_TAG, start);
+    trace_end(TRACE_GATHER);
+    return ret;
+}
+
+// the root sends to every process at once, straight from send_data
+static MIMPI_Retcode scatter_linear(void const* send_data, void* recv_data, int count, int root) {
+    if (my_world_rank != root) return MIMPI_Recv(recv_data, count, root, SCATTER_TAG);
+
+    const char* blocks = (const char*) send_data;
+    MIMPI_Request* requests = (MIMPI_Request*) scratch_alloc(my_world_size * sizeof(MIMPI_Request));
+    MIMPI_Retcode ret = MIMPI_SUCCESS;
+    for (int k = 0; k < my_world_size; k++) {
+        // starting after the root, as the chain in MIMPI_Bcast
+        int i = (root + k) % my_world_size;
+        requests[k] = MIMPI_REQUEST_NULL;
+        if (i != root && ret == MIMPI_SUCCESS) {
+            ret = MIMPI_Isend(blocks + (size_t) i * count, count, i, SCATTER_TAG, &requests[k]);
+        }
+    }
+    const char* own = blocks + (size_t) root * count;
+    if (own != recv_data) memcpy(recv_data, own, count);
+
+    MIMPI_Retcode wait_ret = MIMPI_Waitall(my_world_size, requests);
+    return ret != MIMPI_SUCCESS ? ret : wait_ret;
+}
+
+static MIMPI_Retcode scatter_binomial(void const* send_data, void* recv_data, int count, int root) {
+    // every process gets the blocks of its binomial subtree in relative rank order,
+    // keeps the first one and passes the rest on to its children
+    int v = relative_rank(root);
+    char* buf;
+    if (v != 0) {
+        buf = (char*) scratch_alloc((size_t) subtree_size(v) * count);
+        MIMPI_CHECK(MIMPI_Recv(buf, subtree_size(v) * count, binomial_parent(root), SCATTER_TAG));
+    }
+    else if (root == 0) {
+        buf = (char*) send_data;
+    }
+    else {
+        buf = (char*) scratch_alloc((size_t) my_world_size * count);
+        rotate_blocks(buf, send_data, count, root);
+    }
+
+    // largest subtrees first
+    int children[MAX_TREE_CHILDREN];
+    int num = binomial_children(root, children);
+    MIMPI_Request requests[MAX_TREE_CHILDREN];
+    MIMPI_Retcode ret = MIMPI_SUCCESS;
+    for (int i = 0; i < num; i++) {
+        int c = relative_rank_of(children[i], root);
+        requests[i] = MIMPI_REQUEST_NULL;
+        if (ret == MIMPI_SUCCESS) {
+            ret = MIMPI_Isend(buf + (size_t) (c - v) * count, subtree_size(c) * count, children[i], SCATTER_TAG, &requests[i]);
+        }
+    }
+    if (buf != recv_data) memcpy(recv_data, buf, count);
+
+    MIMPI_Retcode wait_ret = MIMPI_Waitall(num, requests);
+    return ret != MIMPI_SUCCESS ? ret : wait_ret;
+}
+
+static MIMPI_Retcode scatter(void const* send_data, void* recv_data, int count, int root) {
+    // check error
+    if (root < 0 || root >= my_world_size) return MIMPI_ERROR_NO_SUCH_RANK;
+
+    // scratch memory of the previous collective is reused
+    scratch_reset();
+
+    if (tuning_select(COLL_SCATTER, my_world_size, count) == SCATTER_LINEAR) {
+        return scatter_linear(send_data, recv_data, count, root);
+    }
+    return scatter_binomial(send_data, recv_data, count, root);
+}
+
+MIMPI_Retcode MIMPI_Scatter(void const* send_data, void* recv_data, int count, int root) {
+    trace_begin(TRACE_SCATTER, root, SCATTER_TAG, count);
+    uint64_t start = stats_clock();
+    MIMPI_Retcode ret = scatter(send_data, recv_data, count, root);
+    stats_collective(SCATTER_TAG, start);
+    trace_end(TRACE_SCATTER);
+    return ret;
+}
+
+static MIMPI_Retcode allgather_ring(void const* send_data, void* recv_data, int count) {
+    int next = (my_world_rank + 1) % my_world_size;
+    int prev = (my_world_rank + my_world_size - 1) % my_world_size;
+    char* blocks = (char*) recv_data;
+
+    char* own = blocks + (size_t) my_world_rank * count;
+    if (own != send_data) memcpy(own, send_data, count);
+
+    // in step k every process passes on the block it got in step k - 1 (its own first),
+    // so after n - 1 steps around the ring every block has reached everybody
+    for (int k = 0; k < my_world_size - 1; k++) {
+        int send_block = (my_world_rank - k + my_world_size) % my_world_size;
+        int recv_block = (my_world_rank - k - 1 + my_world_size) % my_world_size;
+        MIMPI_CHECK(exchange(blocks + (size_t) send_block * count, count, next,
+                             blocks + (size_t) recv_block * count, count, prev, ALLGATHER_TAG));
+    }
+    return MIMPI_SUCCESS;
+}
+
+static MIMPI_Retcode allgather(void const* send_data, void* recv_data, int count) {
+    // with small blocks, log n steps of gathering to process 0 and broadcasting back
+    // beat the n - 1 steps around the ring
+    if (tuning_select(COLL_ALLGATHER, my_world_size, count) == ALLGATHER_GATHER_BCAST) {
+        MIMPI_CHECK(gather(send_data, recv_data, count, 0));
+        return bcast(recv_data, my_world_size * count, 0);
+    }
+    return allgather_ring(send_data, recv_data, count);
+}
+
+MIMPI_Retcode MIMPI_Allgather(void const* send_data, void* recv_data, int count) {
+    trace_begin(TRACE_ALLGATHER, -1, ALLGATHER_TAG, count);
+    uint64_t start = stats_clock();
+    MIMPI_Retcode ret = allgather(send_data, recv_data, count);
+    stats_collective(ALLGATHER_TAG, start);
+    trace_end(TRACE_ALLGATHER);
+    return ret;
+}
+
+static MIMPI_Retcode alltoall(void const* send_data, void* recv_data, int count) {
+    // scratch memory of the previous collective is reused
+    scratch_reset();
+
+    int n = my_world_size;
+    memcpy((char*) recv_data + (size_t) my_world_rank * count, (const char*) send_data + (size_t) my_world_rank * count, count);
+
+    // all receives are posted first, so that blocks go straight into recv_data, then in step k
+    // every process sends to rank + k and waits for the block from rank - k before the next step,
+    // so that in every step each one has a single peer either way
+    MIMPI_Request* receives = (MIMPI_Request*) scratch_alloc((n - 1) * sizeof(MIMPI_Request));
+    MIMPI_Retcode ret = MIMPI_SUCCESS;
+    for (int k = 1; k < n; k++) {
+        int from = (my_world_rank - k + n) % n;
+        receives[k - 1] = MIMPI_REQUEST_NULL;
+        if (ret == MIMPI_SUCCESS) {
+            ret = MIMPI_Irecv((char*) recv_data + (size_t) from * count, count, from, ALLTOALL_TAG, &receives[k - 1]);
+        }
+    }
+    for (int k = 1; k < n && ret == MIMPI_SUCCESS; k++) {
+        int to = (my_world_rank + k) % n;
+        ret = MIMPI_Send((const char*) send_data + (size_t) to * count, count, to, ALLTOALL_TAG);
+        if (ret == MIMPI_SUCCESS) ret = MIMPI_Wait(&receives[k - 1]);
+    }
+
+    // receives posted before an error must not outlive the scratch memory
+    MIMPI_Retcode wait_ret = MIMPI_Waitall(n - 1, receives);
+    return ret != MIMPI_SUCCESS ? ret : wait_ret;
+}
+
+MIMPI_Retcode MIMPI_Alltoall(void const* send_data, void* recv_data, int count) {
+    trace_begin(TRACE_ALLTOALL, -1, ALLTOALL_TAG, count);
+    uint64_t start = stats_clock();
+    MIMPI_Retcode ret = alltoall(send_data, recv_data, count);
+    stats_collective(ALLTOALL_TAG, start);
+    trace_end(TRACE_ALLTOALL);
+    return ret;
+}
@@ -12,8 +12,16 @@ typedef enum {
     MIMPI_ERROR_NO_SUCH_RANK = 2, /// no process with requested rank exists in the world
     MIMPI_ERROR_REMOTE_FINISHED = 3, /// the remote process involved in communication has finished
     MIMPI_ERROR_DEADLOCK_DETECTED = 4, /// a deadlock has been detected
+    MIMPI_ERROR_INVALID_ARGUMENT = 5, /// a datatype or an operation is not one of the defined values
 } MIMPI_Retcode;
 
+/// Handle of a non-blocking operation started with @ref MIMPI_Isend()
+/// or @ref MIMPI_Irecv().
+typedef struct Request* MIMPI_Request;
+
+/// Handle of no operation; completed requests are reset to it.
+#define MIMPI_REQUEST_NULL ((MIMPI_Request) 0)
+
 /// @brief Reduction operation kind.
 ///
 /// Type of operation performed in @ref MIMPI_Reduce().
@@ -24,12 +32,27 @@ typedef enum {
     MIMPI_PROD,
 } MIMPI_Op;
 
+/// @brief Reduction element type.
+///
+/// Type of elements combined in @ref MIMPI_Reduce(). Signed integers
+/// wrap around on overflow.
+typedef enum {
+    MIMPI_UINT8,
+    MIMPI_INT32,
+    MIMPI_UINT32,
+    MIMPI_INT64,
+    MIMPI_UINT64,
+    MIMPI_FLOAT,
+    MIMPI_DOUBLE,
+} MIMPI_Datatype;
+
 /// @brief Initialises MIMPI framework in MIMPI programs.
 ///
 /// Opens an _MPI block_, permitting use of other MIMPI procedures.
 /// @param enable_deadlock_detection - a flag whether deadlock detection
-///        should be enabled or not. Note that this adds a considerable
-///        overhead, so should only be used when needed.
+///        should be enabled or not. It costs a control message per process
+///        on the way whenever a thread has slept in a receive for longer than
+///        `MIMPI_PROBE_DELAY` microseconds (1000 by default).
 ///
 void MIMPI_Init(bool enable_deadlock_detection);
 
@@ -54,7 +77,11 @@ int MIMPI_World_rank();
 /// @brief Sends data to the specified process.
 ///
 /// Sends @ref count bytes of @ref data to the process with rank @ref destination.
-/// Data is tagged with @ref tag.
+/// Data is tagged with @ref tag. A message larger than the eager limit
+/// (`MIMPI_EAGER_LIMIT`) is sent only once the matching receive is posted,
+/// a smaller one waits only while the recipient has too much from this process
+/// buffered (see `MIMPI_CREDITS`). Should the recipient never receive,
+/// such a send hangs unless deadlock detection is enabled.
 ///
 /// @param data - data to be sent.
 /// @param count - number of bytes of data to be sent.
@@ -68,6 +95,12 @@ int MIMPI_World_rank();
 ///           @ref destination in the world.
 ///         - `MIMPI_ERROR_REMOTE_FINISHED` if the process with rank
 ///         - @ref destination has already escaped _MPI block_.
+///         - `MIMPI_ERROR_DEADLOCK_DETECTED` if a message larger than the eager
+///           limit waits for a receive that can never be posted (with deadlock
+///           detection on); the message is still delivered should a matching
+///           receive be posted later. Also if a smaller message waits for
+///           the recipient to consume buffered ones, which it never does; such
+///           a message is not delivered.
 ///
 MIMPI_Retcode MIMPI_Send(
     void const *data,
@@ -103,6 +136,105 @@ MIMPI_Retcode MIMPI_Recv(
     int tag
 );
 
+/// @brief Starts sending data to the specified process.
+///
+/// Non-blocking counterpart of @ref MIMPI_Send. The message is transferred
+/// in the background and may not be modified until the returned request
+/// completes. Messages to the same process arrive in the order of calls,
+/// whether blocking or not.
+///
+/// @param data - data to be sent.
+/// @param count - number of bytes of data to be sent.
+/// @param destination - rank of the process who is to receive the data.
+/// @param tag - a discriminant of the data, which can be used
+///              to distinguish between messages.
+/// @param request - place where the handle of the operation is to be put.
+/// @return MIMPI return code (on failure, @ref request is set to
+///         `MIMPI_REQUEST_NULL`):
+///         - `MIMPI_SUCCESS` if the operation was started.
+///         - `MIMPI_ERROR_ATTEMPTED_SELF_OP` if process attempted to send to itself
+///         - `MIMPI_ERROR_NO_SUCH_RANK` if there is no process with rank
+///           @ref destination in the world.
+///         - `MIMPI_ERROR_REMOTE_FINISHED` if the process with rank
+///           @ref destination has already escaped _MPI block_.
+///
+MIMPI_Retcode MIMPI_Isend(
+    void const *data,
+    int count,
+    int destination,
+    int tag,
+    MIMPI_Request *request
+);
+
+/// @brief Starts receiving data from the specified process.
+///
+/// Non-blocking counterpart of @ref MIMPI_Recv. Matching message is put
+/// in @ref data by the time the returned request completes.
+/// Deadlock detection covers the receive only while a thread waits for it
+/// alone, in @ref MIMPI_Wait or @ref MIMPI_Waitall.
+///
+/// @param data - place where received data is to be put.
+/// @param count - number of bytes of data to be received.
+/// @param source - rank of the process for data from we are waiting.
+/// @param tag - a discriminant of the data, which can be used
+///              to distinguish between messages.
+/// @param request - place where the handle of the operation is to be put.
+/// @return MIMPI return code (on failure, @ref request is set to
+///         `MIMPI_REQUEST_NULL`):
+///         - `MIMPI_SUCCESS` if the operation was started.
+///         - `MIMPI_ERROR_ATTEMPTED_SELF_OP` if process attempted to receive from itself
+///         - `MIMPI_ERROR_NO_SUCH_RANK` if there is no process with rank
+///           @ref source in the world.
+///
+MIMPI_Retcode MIMPI_Irecv(
+    void *data,
+    int count,
+    int source,
+    int tag,
+    MIMPI_Request *request
+);
+
+/// @brief Waits for a non-blocking operation to complete.
+///
+/// Releases the request and sets @ref request to `MIMPI_REQUEST_NULL`.
+/// Returns immediately if it already is `MIMPI_REQUEST_NULL`.
+///
+/// @param request - handle of the operation.
+/// @return MIMPI return code of the operation, as its blocking
+///         counterpart would return it.
+///
+MIMPI_Retcode MIMPI_Wait(MIMPI_Request *request);
+
+/// @brief Checks whether a non-blocking operation has completed.
+///
+/// If it has, behaves as @ref MIMPI_Wait. Never blocks.
+///
+/// @param request - handle of the operation.
+/// @param flag - place where it is put whether the operation has completed.
+/// @return MIMPI return code of the operation if it has completed,
+///         `MIMPI_SUCCESS` otherwise.
+///
+MIMPI_Retcode MIMPI_Test(MIMPI_Request *request, bool *flag);
+
+/// @brief Waits for all of the non-blocking operations to complete.
+///
+/// @param count - number of requests.
+/// @param requests - handles of the operations, `MIMPI_REQUEST_NULL` ones are skipped.
+/// @return first MIMPI return code other than `MIMPI_SUCCESS` of any
+///         of the operations, `MIMPI_SUCCESS` if there was none.
+///
+MIMPI_Retcode MIMPI_Waitall(int count, MIMPI_Request *requests);
+
+/// @brief Waits for any of the non-blocking operations to complete.
+///
+/// @param count - number of requests.
+/// @param requests - handles of the operations, `MIMPI_REQUEST_NULL` ones are skipped.
+/// @param index - place where the index of the completed operation is put,
+///                or -1 if all requests are `MIMPI_REQUEST_NULL`.
+/// @return MIMPI return code of the completed operation.
+///
+MIMPI_Retcode MIMPI_Waitany(int count, MIMPI_Request *requests, int *index);
+
 /// @brief Synchronises all processes.
 ///
 /// Blocks execution of the calling process until all processes execute
@@ -147,14 +279,16 @@ MIMPI_Retcode MIMPI_Bcast(
 
 /// @brief Reduces data from all processes to one.
 ///
-/// Performs reduction of kind @ref op over @ref count bytes of data
-/// stored at address @ref send_data in every process. The reduction's result
-/// is put at @ref recv_data *ONLY* in the process with rank @ref root.
-/// Additionally, is a synchronisation point similarly to @ref MIMPI_Barrier.
+/// Performs reduction of kind @ref op over @ref count elements of type
+/// @ref datatype stored at address @ref send_data in every process.
+/// The reduction's result is put at @ref recv_data *ONLY* in the process
+/// with rank @ref root. Unlike the other group procedures, it is not
+/// a synchronisation point.
 ///
 /// @param send_data - data to be reduced.
 /// @param recv_data - place where reduction's result is to be put.
-/// @param count - number of bytes of data to be reduced.
+/// @param count - number of elements of data to be reduced.
+/// @param datatype - type of the elements.
 /// @param op - a particular operation to be performed for reduction.
 /// @param root - rank of the process who is to hold the result of reduction.
 ///
@@ -162,6 +296,8 @@ MIMPI_Retcode MIMPI_Bcast(
 ///         - `MIMPI_SUCCESS` if operation ended successfully.
 ///         - `MIMPI_ERROR_NO_SUCH_RANK` if there is no process with rank
 ///           @ref root in the world.
+///         - `MIMPI_ERROR_INVALID_ARGUMENT` if @ref datatype or @ref op
+///           is not a defined value.
 ///         - `MIMPI_ERROR_REMOTE_FINISHED` if any process in the world
 ///            has already escaped _MPI block_.
 ///         - `MIMPI_ERROR_DEADLOCK_DETECTED` if a deadlock has been detected
@@ -171,8 +307,140 @@ MIMPI_Retcode MIMPI_Reduce(
     void const *send_data,
     void *recv_data,
     int count,
+    MIMPI_Datatype datatype,
     MIMPI_Op op,
     int root
 );
 
+/// @brief Reduces data and gives the result to every process.
+///
+/// Performs reduction of kind @ref op over @ref count elements of type
+/// @ref datatype stored at address @ref send_data in every process, and
+/// puts the reduction's result at @ref recv_data in every process.
+/// Is a synchronisation point similarly to @ref MIMPI_Barrier.
+///
+/// @param send_data - data to be reduced (may be the same as @ref recv_data).
+/// @param recv_data - place where reduction's result is to be put.
+/// @param count - number of elements of data to be reduced.
+/// @param datatype - type of the elements.
+/// @param op - a particular operation to be performed for reduction.
+///
+/// @return MIMPI return code:
+///         - `MIMPI_SUCCESS` if operation ended successfully.
+///         - `MIMPI_ERROR_INVALID_ARGUMENT` if @ref datatype or @ref op
+///           is not a defined value.
+///         - `MIMPI_ERROR_REMOTE_FINISHED` if any process in the world
+///            has already escaped _MPI block_.
+///         - `MIMPI_ERROR_DEADLOCK_DETECTED` if a deadlock has been detected
+///           and therefore this call would else never return.
+///
+MIMPI_Retcode MIMPI_Allreduce(
+    void const *send_data,
+    void *recv_data,
+    int count,
+    MIMPI_Datatype datatype,
+    MIMPI_Op op
+);
+
+/// @brief Collects data of every process in one process.
+///
+/// Puts @ref count bytes of @ref send_data of process i at
+/// @ref recv_data + i * @ref count in the process with rank @ref root
+/// (@ref recv_data is only used there). Like @ref MIMPI_Reduce,
+/// it is not a synchronisation point.
+///
+/// @param send_data - data of this process.
+/// @param recv_data - place for the data of all processes, in rank order.
+/// @param count - number of bytes sent by every process.
+/// @param root - rank of the process who is to collect the data.
+///
+/// @return MIMPI return code:
+///         - `MIMPI_SUCCESS` if operation ended successfully.
+///         - `MIMPI_ERROR_NO_SUCH_RANK` if there is no process with rank
+///           @ref root in the world.
+///         - `MIMPI_ERROR_REMOTE_FINISHED` if any process in the world
+///            has already escaped _MPI block_.
+///         - `MIMPI_ERROR_DEADLOCK_DETECTED` if a deadlock has been detected
+///           and therefore this call would else never return.
+///
+MIMPI_Retcode MIMPI_Gather(
+    void const *send_data,
+    void *recv_data,
+    int count,
+    int root
+);
+
+/// @brief Distributes parts of one process' data to every process.
+///
+/// Puts @ref count bytes of @ref send_data + i * @ref count of the process
+/// with rank @ref root at @ref recv_data in process i (@ref send_data
+/// is only used in the root). It is not a synchronisation point.
+///
+/// @param send_data - data for all processes, in rank order.
+/// @param recv_data - place for this process' part.
+/// @param count - number of bytes received by every process.
+/// @param root - rank of the process whose data is distributed.
+///
+/// @return MIMPI return code:
+///         - `MIMPI_SUCCESS` if operation ended successfully.
+///         - `MIMPI_ERROR_NO_SUCH_RANK` if there is no process with rank
+///           @ref root in the world.
+///         - `MIMPI_ERROR_REMOTE_FINISHED` if any process in the world
+///            has already escaped _MPI block_.
+///         - `MIMPI_ERROR_DEADLOCK_DETECTED` if a deadlock has been detected
+///           and therefore this call would else never return.
+///
+MIMPI_Retcode MIMPI_Scatter(
+    void const *send_data,
+    void *recv_data,
+    int count,
+    int root
+);
+
+/// @brief Collects data of every process in every process.
+///
+/// Puts @ref count bytes of @ref send_data of process i at
+/// @ref recv_data + i * @ref count in every process.
+/// Is a synchronisation point similarly to @ref MIMPI_Barrier.
+///
+/// @param send_data - data of this process.
+/// @param recv_data - place for the data of all processes, in rank order.
+/// @param count - number of bytes sent by every process.
+///
+/// @return MIMPI return code:
+///         - `MIMPI_SUCCESS` if operation ended successfully.
+///         - `MIMPI_ERROR_REMOTE_FINISHED` if any process in the world
+///            has already escaped _MPI block_.
+///         - `MIMPI_ERROR_DEADLOCK_DETECTED` if a deadlock has been detected
+///           and therefore this call would else never return.
+///
+MIMPI_Retcode MIMPI_Allgather(
+    void const *send_data,
+    void *recv_data,
+    int count
+);
+
+/// @brief Exchanges a separate part of data between every pair of processes.
+///
+/// Puts @ref count bytes of @ref send_data + j * @ref count of process i
+/// at @ref recv_data + i * @ref count in process j.
+/// Is a synchronisation point similarly to @ref MIMPI_Barrier.
+///
+/// @param send_data - data for all processes, in rank order.
+/// @param recv_data - place for the data from all processes, in rank order.
+/// @param count - number of bytes sent to every process.
+///
+/// @return MIMPI return code:
+///         - `MIMPI_SUCCESS` if operation ended successfully.
+///         - `MIMPI_ERROR_REMOTE_FINISHED` if any process in the world
+///            has already escaped _MPI block_.
+///         - `MIMPI_ERROR_DEADLOCK_DETECTED` if a deadlock has been detected
+///           and therefore this call would else never return.
+///
+MIMPI_Retcode MIMPI_Alltoall(
+    void const *send_data,
+    void *recv_data,
+    int count
+);
+
 #endif /* MIMPI_H */
@@ -3,7 +3,11 @@
  * MIMPI library (mimpi.c) and mimpirun program (mimpirun.c).
  * */
 
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
 #include "mimpi_common.h"
+#include "pool.h"
 
 _Noreturn void syserr(const char* fmt, ...) {
     va_list fmt_args;
@@ -33,22 +37,30 @@ _Noreturn void fatal(const char* fmt, ...) {
 /////////////////////////////////////////////////
 // Put your implementation here
 
+// transport is selected at launch with MIMPI_TRANSPORT (inherited by all ranks)
+transport_t get_transport() {
+    const char* name = getenv("MIMPI_TRANSPORT");
+    if (name == NULL || strcmp(name, "pipe") == 0) return TRANSPORT_PIPE;
+    if (strcmp(name, "shm") == 0) return TRANSPORT_SHM;
+    if (strcmp(name, "mux") == 0) return TRANSPORT_MUX;
+    fatal("Unknown MIMPI_TRANSPORT: %s", name);
+}
+
 // allocate a single node
-static node_t* node_create(int tag, int count, char* data) {
-    node_t* new_node = (node_t*) malloc(sizeof(node_t));
-    assert(new_node != NULL);
+node_t* node_create(int tag, int count, char* data) {
+    node_t* new_node = (node_t*) pool_alloc(sizeof(node_t));
+    memset(new_node, 0, sizeof(node_t));
 
     new_node->tag = tag;
     new_node->count = count;
     new_node->data = data;
-    new_node->next = NULL;
 
     return new_node;
 }
 
 static void node_destroy(node_t* node) {
-    free(node->data); // this will be called only for unread messages
-    free(node);
+    if (node->data != NULL) pool_free(node->data, node->count); // this will be called only for unread messages
+    pool_free(node, sizeof(node_t));
 }
 
 // free the space occupied by a list
@@ -62,6 +74,87 @@ static void list_destroy(node_t* head) {
     }
 }
 
+#define INITIAL_BUCKETS 16
+
+static size_t key_hash(int tag, int count) {
+    uint64_t h = (uint32_t) tag * 0x9E3779B97F4A7C15ULL ^ (uint32_t) count * 0xC2B2AE3D27D4EB4FULL;
+    return (size_t) (h ^ (h >> 29));
+}
+
+static void index_init(index_t* index) {
+    index->num_buckets = INITIAL_BUCKETS;
+    index->num_queues = 0;
+    index->buckets = (queue_t**) calloc(index->num_buckets, sizeof(queue_t*));
+    assert(index->buckets != NULL);
+}
+
+static void index_destroy(index_t* index) {
+    for (size_t i = 0; i < index->num_buckets; i++) {
+        queue_t* current = index->buckets[i];
+        while (current != NULL) {
+            queue_t* next = current->chain;
+            pool_free(current, sizeof(queue_t)); // nodes are owned by the arrival list
+            current = next;
+        }
+    }
+    free(index->buckets);
+}
+
+// double the number of buckets once the load factor exceeds 1
+static void index_grow(index_t* index) {
+    size_t num_buckets = 2 * index->num_buckets;
+    queue_t** buckets = (queue_t**) calloc(num_buckets, sizeof(queue_t*));
+    assert(buckets != NULL);
+    for (size_t i = 0; i < index->num_buckets; i++) {
+        queue_t* current = index->buckets[i];
+        while (current != NULL) {
+            queue_t* next = current->chain;
+            size_t b = key_hash(current->tag, current->count) & (num_buckets - 1);
+            current->chain = buckets[b];
+            buckets[b] = current;
+            current = next;
+        }
+    }
+    free(index->buckets);
+    index->buckets = buckets;
+    index->num_buckets = num_buckets;
+}
+
+static queue_t* index_find(index_t* index, int tag, int count) {
+    queue_t* current = index->buckets[key_hash(tag, count) & (index->num_buckets - 1)];
+    while (current != NULL && (current->tag != tag || current->count != count)) {
+        current = current->chain;
+    }
+    return current;
+}
+
+static queue_t* index_find_or_create(index_t* index, int tag, int count) {
+    queue_t* queue = index_find(index, tag, count);
+    if (queue != NULL) return queue;
+
+    if (index->num_queues >= index->num_buckets) index_grow(index);
+
+    queue = (queue_t*) pool_alloc(sizeof(queue_t));
+    memset(queue, 0, sizeof(queue_t));
+    queue->tag = tag;
+    queue->count = count;
+
+    size_t b = key_hash(tag, count) & (index->num_buckets - 1);
+    queue->chain = index->buckets[b];
+    index->buckets[b] = queue;
+    index->num_queues++;
+    return queue;
+}
+
+// empty queues are dropped so that memory is bounded by queued messages
+static void index_remove(index_t* index, queue_t* queue) {
+    queue_t** link = &index->buckets[key_hash(queue->tag, queue->count) & (index->num_buckets - 1)];
+    while (*link != queue) link = &(*link)->chain;
+    *link = queue->chain;
+    index->num_queues--;
+    pool_free(queue, sizeof(queue_t));
+}
+
 // allocate a new buffer
 buffer_t* buffer_create() {
     buffer_t* new_buf = (buffer_t*) malloc(sizeof(buffer_t));
@@ -69,6 +162,9 @@ buffer_t* buffer_create() {
 
     new_buf->front = NULL;
     new_buf->rear = NULL;
+    new_buf->size = 0;
+    index_init(&new_buf->by_key);
+    index_init(&new_buf->by_count);
 
     return new_buf;
 }
@@ -76,69 +172,146 @@ buffer_t* buffer_create() {
 // free the space occupied by a buffer
 void buffer_destroy(buffer_t* buf) {
     list_destroy(buf->front);
+    index_destroy(&buf->by_key);
+    index_destroy(&buf->by_count);
     free(buf);
 }
 
-// add message at the end of buffer
+// link node at the end of the arrival order and of its sub-queues
+static void buffer_append(buffer_t* buf, node_t* new_node) {
+    int tag = new_node->tag;
+    int count = new_node->count;
+
+    new_node->prev = buf->rear;
+    if (buf->rear == NULL) buf->front = new_node;
+    else buf->rear->next = new_node;
+    buf->rear = new_node;
+
+    queue_t* key_queue = index_find_or_create(&buf->by_key, tag, count);
+    new_node->key_prev = key_queue->rear;
+    if (key_queue->rear == NULL) key_queue->front = new_node;
+    else key_queue->rear->key_next = new_node;
+    key_queue->rear = new_node;
+
+    queue_t* count_queue = index_find_or_create(&buf->by_count, MIMPI_ANY_TAG, count);
+    new_node->count_prev = count_queue->rear;
+    if (count_queue->rear == NULL) count_queue->front = new_node;
+    else count_queue->rear->count_next = new_node;
+    count_queue->rear = new_node;
+
+    buf->size++;
+}
+
+// add message at the end of buffer, takes ownership of data (from pool_alloc(count))
 void buffer_add(buffer_t* buf, int tag, int count, char* data) {
     node_t* new_node = node_create(tag, count, data);
-    if (buf->rear == NULL) {
-        // buf->front must also be NULL
-        buf->front = new_node;
-        buf->rear = new_node;
-    }
-    else {
-        buf->rear->next = new_node;
-        buf->rear = new_node;
-    }
+    new_node->seq = -1;
+    buffer_append(buf, new_node);
 }
 
+// add a rendezvous send announced by RTS, matched in arrival order like any other message
+void buffer_add_envelope(buffer_t* buf, int tag, int count, int seq) {
+    node_t* new_node = node_create(tag, count, NULL);
+    new_node->seq = seq;
+    buffer_append(buf, new_node);
+}
+
+// unlink node from all three lists, dropping sub-queues that become empty
+static void buffer_unlink(buffer_t* buf, node_t* node) {
+    if (node->prev == NULL) buf->front = node->next;
+    else node->prev->next = node->next;
+    if (node->next == NULL) buf->rear = node->prev;
+    else node->next->prev = node->prev;
+
+    queue_t* key_queue = index_find(&buf->by_key, node->tag, node->count);
+    if (node->key_prev == NULL) key_queue->front = node->key_next;
+    else node->key_prev->key_next = node->key_next;
+    if (node->key_next == NULL) key_queue->rear = node->key_prev;
+    else node->key_next->key_prev = node->key_prev;
+    if (key_queue->front == NULL) index_remove(&buf->by_key, key_queue);
+
+    queue_t* count_queue = index_find(&buf->by_count, MIMPI_ANY_TAG, node->count);
+    if (node->count_prev == NULL) count_queue->front = node->count_next;
+    else node->count_prev->count_next = node->count_next;
+    if (node->count_next == NULL) count_queue->rear = node->count_prev;
+    else node->count_next->count_prev = node->count_prev;
+    if (count_queue->front == NULL) index_remove(&buf->by_count, count_queue);
+
+    buf->size--;
+}
+
+// returns the data of the first (in terms of arrival) matching message, or NULL;
+// seq is set to its rendezvous sequence number, -1 if it was sent eagerly or there is none
+char* extract_matching_data(buffer_t* buf, int tag, int count, int* seq) {
+    *seq = -1;
+    queue_t* queue = tag == MIMPI_ANY_TAG
+        ? index_find(&buf->by_count, MIMPI_ANY_TAG, count)
+        : index_find(&buf->by_key, tag, count);
+    if (queue == NULL) return NULL;
+
+    node_t* current = queue->front;
+    char* ret = current->data;
+    *seq = current->seq;
+    buffer_unlink(buf, current);
 
-char* extract_matching_data(buffer_t* buf, int tag, int count) {
-    char* ret;
-    node_t* prev = NULL;
-    node_t* current = buf->front;
+    // caller of this function will free the data from this node (with pool_free)
+    pool_free(current, sizeof(node_t));
+
+    return ret;
+}
+
+// post a receive at the end of queue
+void request_queue_add(request_queue_t* queue, request_t* req) {
+    req->next = NULL;
+    if (queue->rear == NULL) queue->front = req;
+    else queue->rear->next = req;
+    queue->rear = req;
+}
 
+// unlink and return the first (in terms of posting) receive matching a message, or NULL
+request_t* request_queue_take_matching(request_queue_t* queue, int tag, int count) {
+    request_t* prev = NULL;
+    request_t* current = queue->front;
     while (current != NULL) {
-        if ((current->tag == tag || tag == MIMPI_ANY_TAG) && current->count == count) {
-            ret = current->data;
-            if (current == buf->front && current == buf->rear) {
-                buf->front = NULL;
-                buf->rear = NULL;
-            }
-            else if (current == buf->front) {
-                buf->front = current->next;
-            }
-            else if (current == buf->rear) {
-                assert(prev != NULL);
-                prev->next = NULL;
-                buf->rear = prev;
-            }
-            else {
-                assert(prev != NULL);
-                prev->next = current->next;
-            }
-
-            // caller of this function will free the data from this node
-            free(current);
-
-            return ret;
+        if ((current->tag == tag || current->tag == MIMPI_ANY_TAG) && current->count == count) {
+            if (prev == NULL) queue->front = current->next;
+            else prev->next = current->next;
+            if (queue->rear == current) queue->rear = prev;
+            return current;
         }
         prev = current;
         current = current->next;
     }
-
     return NULL;
 }
 
-// calculate a unique read file descriptor for transfer channel from process 'i' to process 'j'
-int get_transfer_read_fd(int i, int j) {
-    return 20 + 2 * (16 * i + j);
+// withdraw a receive that is still posted
+void request_queue_remove(request_queue_t* queue, request_t* req) {
+    request_t* prev = NULL;
+    request_t* current = queue->front;
+    while (current != req) {
+        prev = current;
+        current = current->next;
+    }
+    if (prev == NULL) queue->front = current->next;
+    else prev->next = current->next;
+    if (queue->rear == current) queue->rear = prev;
+}
+
+// channels may be non-blocking, in which case the *_full helpers wait for them
+static void wait_fd(int fd, short events) {
+    struct pollfd pfd = { .fd = fd, .events = events };
+    int ret;
+    do {
+        ret = poll(&pfd, 1, -1);
+    } while (ret == -1 && errno == EINTR);
+    ASSERT_SYS_OK(ret);
 }
 
-// calculate a unique write file descriptor for transfer channel from process 'i' to process 'j'
-int get_transfer_write_fd(int i, int j) {
-    return 20 + 2 * (16 * i + j) + 1;
+void set_nonblocking(int fd) {
+    int flags;
+    ASSERT_SYS_OK(flags = fcntl(fd, F_GETFL));
+    ASSERT_SYS_OK(fcntl(fd, F_SETFL, flags | O_NONBLOCK));
 }
 
 void write_full(int fd, const void* data, size_t count) {
@@ -148,6 +321,10 @@ void write_full(int fd, const void* data, size_t count) {
     while (total_written < count) {
         bytes_written = chsend(fd, buf + total_written, count - total_written);
         if (bytes_written == -1 && errno == EINTR) continue;
+        if (bytes_written == -1 && errno == EAGAIN) {
+            wait_fd(fd, POLLOUT);
+            continue;
+        }
         ASSERT_SYS_OK(bytes_written);
         assert(bytes_written > 0);
         total_written += bytes_written;
@@ -155,6 +332,30 @@ void write_full(int fd, const void* data, size_t count) {
     assert(total_written == count);
 }
 
+// write the concatenation of iov[0..iovcnt) in full, advancing over partial writes (iov is modified)
+void writev_full(int fd, struct iovec* iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t bytes_written = chsendv(fd, iov, iovcnt);
+        if (bytes_written == -1 && errno == EINTR) continue;
+        if (bytes_written == -1 && errno == EAGAIN) {
+            wait_fd(fd, POLLOUT);
+            continue;
+        }
+        ASSERT_SYS_OK(bytes_written);
+        assert(bytes_written > 0);
+        size_t remaining = (size_t) bytes_written;
+        while (iovcnt > 0 && remaining >= iov->iov_len) {
+            remaining -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + remaining;
+            iov->iov_len -= remaining;
+        }
+    }
+}
+
 void read_full(int fd, void* data, size_t count) {
     size_t total_read = 0;
     ssize_t bytes_read;
@@ -162,6 +363,10 @@ void read_full(int fd, void* data, size_t count) {
     while (total_read < count) {
         bytes_read = chrecv(fd, buf + total_read, count - total_read);
         if (bytes_read == -1 && errno == EINTR) continue;
+        if (bytes_read == -1 && errno == EAGAIN) {
+            wait_fd(fd, POLLIN);
+            continue;
+        }
         ASSERT_SYS_OK(bytes_read);
         assert(bytes_read > 0);
         total_read += bytes_read;
@@ -169,59 +374,73 @@ void read_full(int fd, void* data, size_t count) {
     assert(total_read == count);
 }
 
-// mimpirun
-void close_all_transfer_fds(int n) {
-    for (int i = 0; i < n; i++) {
-        for (int j = 0; j < n; j++) {
-            ASSERT_SYS_OK(close(get_transfer_read_fd(i, j)));
-            ASSERT_SYS_OK(close(get_transfer_write_fd(i, j)));
-        }
-    }
+void channel_table_create(channel_table_t* table, int num_read, int num_write) {
+    table->num_read = num_read;
+    table->num_write = num_write;
+    table->read_fds = (int*) malloc(num_read * sizeof(int));
+    table->write_fds = (int*) malloc(num_write * sizeof(int));
+    assert(table->read_fds != NULL);
+    assert(table->write_fds != NULL);
 }
 
-// MIMPI_Init
-void close_foreign_transfer_fds(int rank, int n) {
+void channel_table_destroy(channel_table_t* table) {
+    free(table->read_fds);
+    free(table->write_fds);
+}
+
+static char* format_fds(char* end, const int* fds, int n) {
     for (int i = 0; i < n; i++) {
-        for (int j = 0; j < n; j++) {
-            if (i != rank && j != rank) {
-                ASSERT_SYS_OK(close(get_transfer_read_fd(i, j)));
-                ASSERT_SYS_OK(close(get_transfer_write_fd(i, j)));
-            }
-        }
+        end += sprintf(end, "%s%d", i == 0 ? "" : ",", fds[i]);
     }
+    return end;
 }
 
-// MIMPI_Init
-void close_my_incoming_transfer_write_fds(int rank, int n) {
+// mimpirun (serialized as "r0,r1,...;w0,w1,...", caller frees the result)
+char* channel_table_format(const channel_table_t* table) {
+    // descriptors are below 10000, so every entry takes at most 5 characters
+    char* str = (char*) malloc(5 * (table->num_read + table->num_write) + 2);
+    assert(str != NULL);
+    char* end = format_fds(str, table->read_fds, table->num_read);
+    *end++ = ';';
+    format_fds(end, table->write_fds, table->num_write);
+    return str;
+}
+
+static const char* parse_fds(const char* str, int* fds, int n, char terminator) {
+    char* end;
     for (int i = 0; i < n; i++) {
-        if (i != rank) {
-            ASSERT_SYS_OK(close(get_transfer_write_fd(i, rank)));
-        }
+        fds[i] = (int) strtol(str, &end, 10);
+        assert(*end == (i == n - 1 ? terminator : ','));
+        str = end + 1;
     }
+    return str;
 }
 
 // MIMPI_Init
-void close_my_outgoing_transfer_read_fds(int rank, int n) {
-    for (int i = 0; i < n; i++) {
-        if (i != rank) {
-            ASSERT_SYS_OK(close(get_transfer_read_fd(rank, i)));
-        }
-    }
+void channel_table_load(channel_table_t* table, int num_read, int num_write) {
+    const char* str = getenv(CHANNEL_TABLE_VAR);
+    if (str == NULL) fatal("%s is not set, was the program started by mimpirun?", CHANNEL_TABLE_VAR);
+
+    channel_table_create(table, num_read, num_write);
+    str = parse_fds(str, table->read_fds, num_read, ';');
+    parse_fds(str, table->write_fds, num_write, '\0');
 }
 
 // MIMPI_Finalize (used to trigger POLLHUPs)
-void close_my_outgoing_transfer_write_fds(int rank, int n) {
-    for (int i = 0; i < n; i++) {
+void close_my_outgoing_transfer_write_fds(const channel_table_t* table) {
+    // what was sent must not be cut off by the close
+    channels_flush();
+    for (int i = 0; i < table->num_write; i++) {
         // including i == rank
-        ASSERT_SYS_OK(close(get_transfer_write_fd(rank, i)));
+        ASSERT_SYS_OK(close(table->write_fds[i]));
     }
 }
 
 // MIPI_Finalize (used at the very end)
-void close_my_incoming_transfer_read_fds(int rank, int n) {
-    for (int i = 0; i < n; i++) {
+void close_my_incoming_transfer_read_fds(const channel_table_t* table) {
+    for (int i = 0; i < table->num_read; i++) {
         // including i == rank
-        ASSERT_SYS_OK(close(get_transfer_read_fd(i, rank)));
+        ASSERT_SYS_OK(close(table->read_fds[i]));
     }
 }
 
@@ -232,31 +451,17 @@ void dup_fd(int from_fd, int to_fd) {
     }
 }
 
-void* merge_data(const void* data1, size_t count1, const void* data2, size_t count2) {
-    char* new_data = (char*) malloc(count1 + count2);
-    assert(new_data != NULL);
-    memcpy(new_data, (char*)data1, count1);
-    memcpy(new_data + count1, (char*)data2, count2);
-    return new_data;
-}
-
-void partially_reduce(u_int8_t* partial, const u_int8_t* update, int count, MIMPI_Op op) {
-    for (int i = 0; i < count; i++) {
-        switch (op) {
-            case MIMPI_MAX:
-                partial[i] = MAX(partial[i], update[i]);
-                break;
-            case MIMPI_MIN:
-                partial[i] = MIN(partial[i], update[i]);
-                break;
-            case MIMPI_SUM:
-                partial[i] = SUM(partial[i], update[i]);
-                break;
-            case MIMPI_PROD:
-                partial[i] = PROD(partial[i], update[i]);
-                break;
-        }
-    }
+uint64_t monotonic_ns() {
+    struct timespec ts;
+    ASSERT_SYS_OK(clock_gettime(CLOCK_MONOTONIC, &ts));
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// the per-process files of MIMPI_STATS and MIMPI_TRACE and what mimpirun merges them into
+FILE* open_in_dir(const char* dir, const char* name, const char* mode) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return fopen(path, mode);
 }
 
 
@@ -11,6 +11,7 @@
 #include <stdnoreturn.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -62,12 +63,50 @@ _Noreturn extern void fatal(const char* fmt, ...);
 // Put your declarations here
 
 #define BARRIER_WAIT 10
-#define BARRIER_WAKE 20
+#define BCAST_READY 30
+
+// MIMPI_Bcast by default sends larger messages down a chain in segments, so that they are pipelined
+#define BCAST_CHAIN_MIN (256 * 1024)
+#define BCAST_SEGMENT_SIZE (32 * 1024)
+#define BCAST_WINDOW 4 // segments a rank may have in flight to the next one
+
+// MIMPI_Reduce combines one segment while the next one is being received
+#define REDUCE_SEGMENT_SIZE (32 * 1024)
+#define REDUCE_WINDOW 4 // segments a rank may have in flight to its parent
+
+// MIMPI_Allreduce by default switches from recursive doubling to a ring from this size on
+#define ALLREDUCE_RING_MIN (128 * 1024)
+
+// a binomial tree over MAX_WORLD_SIZE processes has at most this many children per node
+#define MAX_TREE_CHILDREN 16
 
 #define BARRIER_TAG -2
 #define BCAST_TAG -3
 #define REDUCE_TAG -4
-#define DEADLOCK_TAG -5
+#define DEADLOCK_TAG -5 // deadlock detection probe, see probe_t
+#define EXIT_TAG -6
+#define KICK_TAG -7 // wakes up own worker, never delivered
+#define RTS_TAG -8 // announces a rendezvous send: tag, count and sequence number
+#define CTS_TAG -9 // the receive is posted, the sender may write the data
+#define RNDV_DATA_TAG -10 // data of a rendezvous send, goes to the receive bound by CTS
+#define CREDIT_TAG -11 // returns credits for eager messages the receiver has consumed, none asks for them
+#define ALLREDUCE_TAG -12
+#define GATHER_TAG -13
+#define SCATTER_TAG -14
+#define ALLGATHER_TAG -15
+#define ALLTOALL_TAG -16
+
+// messages larger than this are sent with a rendezvous handshake (overridden by MIMPI_EAGER_LIMIT)
+#define DEFAULT_EAGER_LIMIT (64 * 1024)
+
+// bytes of unexpected messages one peer may have queued at a receiver (overridden by MIMPI_CREDITS)
+#define DEFAULT_CREDITS (4 * 1024 * 1024)
+
+// microseconds a receive waits before deadlock detection probes for it (overridden by MIMPI_PROBE_DELAY)
+#define DEFAULT_PROBE_DELAY 1000
+
+// chsend and chrecv are atomic up to this size
+#define CHANNEL_ATOMIC_SIZE 512
 
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
@@ -101,24 +140,142 @@ _Noreturn extern void fatal(const char* fmt, ...);
         }                                        \
     } while(0)
 
-typedef struct Node {
+// descriptors reserved for the library in every rank
+#define FIRST_CHANNEL_FD 20
+#define LAST_CHANNEL_FD 1023
+
+// with TRANSPORT_PIPE a rank holds one read and one write end per peer (including itself)
+#define MAX_WORLD_SIZE ((LAST_CHANNEL_FD - FIRST_CHANNEL_FD + 1) / 2)
+
+// environment variable through which mimpirun passes the channel table
+#define CHANNEL_TABLE_VAR "MIMPI_CHANNELS"
+
+typedef enum {
+    TRANSPORT_PIPE,
+    TRANSPORT_SHM,
+    TRANSPORT_MUX,
+} transport_t;
+
+// header of every frame written to a shared inbound channel (in case of TRANSPORT_MUX)
+typedef struct FrameHeader {
+    int source;
     int tag;
     int count;
+    int length; // payload bytes in this frame
+} frame_header_t;
+
+#define FRAME_PAYLOAD_SIZE (CHANNEL_ATOMIC_SIZE - sizeof(frame_header_t))
+
+// message being read from one source, piece by piece as it arrives
+// (in case of TRANSPORT_MUX reassembled from frames)
+typedef struct Partial {
+    int header[2];       // tag and count, while not active
+    int header_received;
+    bool active;
+    int tag;
+    int count;
+    int received;
     char* data;
+    struct Request* req; // posted receive data goes to, if any
+    uint64_t started;    // trace clock when the header arrived
+    uint64_t flow;       // trace id of the message
+} partial_t;
+
+// a queued message, linked into the buffer's arrival order
+// and into the FIFO sub-queues of its (tag, count) and count
+typedef struct Node {
+    int tag;
+    int count;
+    char* data; // NULL if announced by RTS, the data is then still at the sender
+    int seq;    // rendezvous sequence number, -1 for a message sent eagerly
+    struct Node* prev;
     struct Node* next;
+    struct Node* key_prev;
+    struct Node* key_next;
+    struct Node* count_prev;
+    struct Node* count_next;
 } node_t;
 
+// FIFO of messages sharing a key, chained in a hash bucket
+typedef struct Queue {
+    int tag; // MIMPI_ANY_TAG in index by count
+    int count;
+    node_t* front;
+    node_t* rear;
+    struct Queue* chain;
+} queue_t;
+
+typedef struct Index {
+    queue_t** buckets;
+    size_t num_buckets; // power of two
+    size_t num_queues;
+} index_t;
+
+// per-source unexpected messages, matched in O(1) on average
+// (by (tag, count) for a given tag, by count for MIMPI_ANY_TAG)
 typedef struct Buffer {
     node_t* front;
     node_t* rear;
+    size_t size;
+    index_t by_key;
+    index_t by_count;
 } buffer_t;
 
-typedef struct Entry {
+typedef enum {
+    REQUEST_SEND,
+    REQUEST_RECV,
+} request_kind_t;
+
+// send queued for the worker, or receive posted by a caller -
+// the worker reads a matching message straight into its data once it arrives
+typedef struct Request {
+    request_kind_t kind;
+    int peer;
     int tag;
     int count;
-    int whoswaiting;
-} entry_t;
-
+    char* data;
+    size_t sent;      // send progress (TRANSPORT_MUX: frames, otherwise bytes of header and data)
+    bool in_progress; // taken by the worker, data is being transferred
+    bool done;
+    bool blocking;    // started by MIMPI_Send or MIMPI_Recv
+    bool detached;    // control message nobody waits for, freed once sent
+    uint32_t wait;    // id of the wait a thread is blocked in for the receive, 0 if none
+    int seq;          // rendezvous sequence number
+    uint64_t write_started; // trace clock when the message started being written
+    uint64_t flow;          // trace id of the message
+    MIMPI_Retcode ret;
+    struct Waiter* waiter; // thread to wake up once the request progresses, if any
+    struct Request* next;
+} request_t;
+
+typedef struct RequestQueue {
+    request_t* front;
+    request_t* rear;
+} request_queue_t;
+
+// descriptors of one rank's transfer channels, indexed by peer rank
+typedef struct ChannelTable {
+    int num_read;
+    int num_write;
+    int* read_fds;  // read_fds[i] - read end of channel i -> this rank (TRANSPORT_MUX: own inbound channel)
+    int* write_fds; // write_fds[i] - write end of channel this rank -> i (TRANSPORT_MUX: inbound channel of i)
+} channel_table_t;
+
+// payload of a DEADLOCK_TAG message, it travels along receives processes are blocked in
+typedef struct Probe {
+    int initiator;     // rank of the process whose blocked receive sent the probe first
+    uint32_t wait;     // id of that receive's wait in the initiator
+    uint32_t probe;    // increases with every probe the initiator sends
+    uint32_t received; // messages the sender of the probe had got from its recipient
+    int failed_initiator;  // the probe that found the cycle the initiator's last failed wait was on
+    uint32_t failed_probe; // (0 if none)
+    bool found;        // the probe came back to its wait, the receives on the cycle fail
+} probe_t;
+
+
+transport_t get_transport();
+
+node_t* node_create(int tag, int count, char* data);
 
 buffer_t* buffer_create();
 
@@ -126,32 +283,40 @@ void buffer_destroy(buffer_t* buf);
 
 void buffer_add(buffer_t* buf, int tag, int count, char* data);
 
-char* extract_matching_data(buffer_t* buf, int tag, int count);
+void buffer_add_envelope(buffer_t* buf, int tag, int count, int seq);
+
+char* extract_matching_data(buffer_t* buf, int tag, int count, int* seq);
 
-int get_transfer_read_fd(int i, int j);
+void request_queue_add(request_queue_t* queue, request_t* req);
 
-int get_transfer_write_fd(int i, int j);
+request_t* request_queue_take_matching(request_queue_t* queue, int tag, int count);
 
-void close_all_transfer_fds(int n);
+void request_queue_remove(request_queue_t* queue, request_t* req);
 
-void close_foreign_transfer_fds(int rank, int n);
+void channel_table_create(channel_table_t* table, int num_read, int num_write);
 
-void close_my_incoming_transfer_write_fds(int rank, int n);
+void channel_table_destroy(channel_table_t* table);
 
-void close_my_outgoing_transfer_read_fds(int rank, int n);
+char* channel_table_format(const channel_table_t* table);
 
-void close_my_outgoing_transfer_write_fds(int rank, int n);
+void channel_table_load(channel_table_t* table, int num_read, int num_write);
 
-void close_my_incoming_transfer_read_fds(int rank, int n);
+void close_my_outgoing_transfer_write_fds(const channel_table_t* table);
+
+void close_my_incoming_transfer_read_fds(const channel_table_t* table);
+
+void set_nonblocking(int fd);
 
 void write_full(int fd, const void* data, size_t n);
 
+void writev_full(int fd, struct iovec* iov, int iovcnt);
+
 void read_full(int fd, void* data, size_t count);
 
 void dup_fd(int from_fd, int to_fd);
 
-void* merge_data(const void* data1, size_t count1, const void* data2, size_t count2);
+uint64_t monotonic_ns();
 
-void partially_reduce(u_int8_t* partial, const u_int8_t* update, int count, MIMPI_Op op);
+FILE* open_in_dir(const char* dir, const char* name, const char* mode);
 
 #endif // MIMPI_COMMON_H
\ No newline at end of file
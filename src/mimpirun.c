@@ -2,12 +2,103 @@
  * This file is for implementation of mimpirun program.
  * */
 
+#define _GNU_SOURCE
+#include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <stdio.h>
 #include "mimpi_common.h"
 #include "channel.h"
+#include "ring.h"
+#include "stats.h"
+#include "trace.h"
+
+// channel ends waiting to be handed to a copy are parked in the lowest free descriptors
+// above the library's range, so that no open entry is ever replaced, with close-on-exec
+// set so that other copies never see them
+static int park_fd(int fd) {
+    int slot;
+    ASSERT_SYS_OK(slot = fcntl(fd, F_DUPFD_CLOEXEC, LAST_CHANNEL_FD + 1));
+    ASSERT_SYS_OK(close(fd));
+    return slot;
+}
+
+static void release_fd(int slot) {
+    ASSERT_SYS_OK(close(slot));
+}
+
+// channel i -> j is created right before the first of copies i and j is started,
+// so at most about n^2 / 2 ends are held at once
+static void create_channels_of(int k, int n, int* pipe_read, int* pipe_write) {
+    int tmp[2];
+    for (int j = k; j < n; j++) {
+        ASSERT_SYS_OK(channel(tmp));
+        pipe_read[k * n + j] = park_fd(tmp[0]);
+        pipe_write[k * n + j] = park_fd(tmp[1]);
+        if (j != k) {
+            ASSERT_SYS_OK(channel(tmp));
+            pipe_read[j * n + k] = park_fd(tmp[0]);
+            pipe_write[j * n + k] = park_fd(tmp[1]);
+        }
+    }
+}
+
+// peak number of channel ends parked at once, see create_channels_of and release_channels_of
+static long parked_ends_needed(transport_t transport, int n) {
+    if (transport == TRANSPORT_MUX) return 2L * n;
+    if (transport != TRANSPORT_PIPE) return 0;
+
+    // while copy k is started, channels i -> j with j >= k and i <= k or j == k are held,
+    // each with both of its ends
+    long peak = 0;
+    for (int k = 0; k < n; k++) {
+        peak = MAX(peak, 2 * (n + (long) (n - 1 - k) * (k + 1)));
+    }
+    return peak;
+}
+
+static void export_channel_table(channel_table_t* table) {
+    char* str = channel_table_format(table);
+    ASSERT_SYS_OK(setenv(CHANNEL_TABLE_VAR, str, 1));
+    free(str);
+    channel_table_destroy(table);
+}
+
+// child process: move own channel ends into the library's range and describe them in the environment
+static void install_channels_of(int k, int n, const int* pipe_read, const int* pipe_write) {
+    channel_table_t table;
+    channel_table_create(&table, n, n);
+    for (int i = 0; i < n; i++) {
+        table.read_fds[i] = FIRST_CHANNEL_FD + i;
+        table.write_fds[i] = FIRST_CHANNEL_FD + n + i;
+        // dup2 clears close-on-exec on the new descriptor
+        ASSERT_SYS_OK(dup2(pipe_read[i * n + k], table.read_fds[i]));
+        ASSERT_SYS_OK(dup2(pipe_write[k * n + i], table.write_fds[i]));
+    }
+    export_channel_table(&table);
+}
+
+// child process in case of TRANSPORT_MUX: own inbound channel and write ends of everyone's
+static void install_inbound_channels_of(int k, int n, const int* inbound_read, const int* inbound_write) {
+    channel_table_t table;
+    channel_table_create(&table, 1, n);
+    table.read_fds[0] = FIRST_CHANNEL_FD;
+    ASSERT_SYS_OK(dup2(inbound_read[k], table.read_fds[0]));
+    for (int i = 0; i < n; i++) {
+        table.write_fds[i] = FIRST_CHANNEL_FD + 1 + i;
+        ASSERT_SYS_OK(dup2(inbound_write[i], table.write_fds[i]));
+    }
+    export_channel_table(&table);
+}
+
+static void release_channels_of(int k, int n, const int* pipe_read, const int* pipe_write) {
+    for (int i = 0; i < n; i++) {
+        release_fd(pipe_read[i * n + k]);
+        release_fd(pipe_write[k * n + i]);
+    }
+}
 
 int main(int argc, char* argv[]) {
 
@@ -15,14 +106,51 @@ int main(int argc, char* argv[]) {
 
     // number of copies of the program to be exec'd
     int n = atoi(argv[1]);
-    assert(1 <= n && n <= 16);
+    assert(1 <= n && n <= MAX_WORLD_SIZE);
 
-    int tmp[2];
-    for (int i = 0; i < n; i++) {
-        for (int j = 0; j < n; j++) {
+    // parked channel ends can take far more descriptors than the default soft limit
+    struct rlimit limit;
+    ASSERT_SYS_OK(getrlimit(RLIMIT_NOFILE, &limit));
+    limit.rlim_cur = limit.rlim_max;
+    ASSERT_SYS_OK(setrlimit(RLIMIT_NOFILE, &limit));
+
+    transport_t transport = get_transport();
+
+    // failing halfway through would leave some copies started and others not
+    long needed = LAST_CHANNEL_FD + 1 + parked_ends_needed(transport, n);
+    if (limit.rlim_cur != RLIM_INFINITY && (rlim_t) needed > limit.rlim_cur) {
+        fatal("%d copies need %ld open files with this transport, but RLIMIT_NOFILE allows %llu; "
+              "use MIMPI_TRANSPORT=%s",
+              n, needed, (unsigned long long) limit.rlim_cur, transport == TRANSPORT_PIPE ? "mux or shm" : "shm");
+    }
+
+    if (transport == TRANSPORT_SHM) {
+        // one segment holding rings for every pair of ranks
+        const char* ring_size_str = getenv("MIMPI_SHM_RING_SIZE");
+        uint32_t ring_size = ring_size_str ? (uint32_t) atoi(ring_size_str) : DEFAULT_RING_SIZE;
+        dup_fd(shm_segment_create(n, ring_size), SHM_SEGMENT_FD);
+    }
+
+    int* pipe_read = NULL;
+    int* pipe_write = NULL;
+    if (transport == TRANSPORT_PIPE) {
+        pipe_read = (int*) malloc(n * n * sizeof(int));
+        pipe_write = (int*) malloc(n * n * sizeof(int));
+        assert(pipe_read != NULL);
+        assert(pipe_write != NULL);
+    }
+    else if (transport == TRANSPORT_MUX) {
+        // one inbound channel per process, all of them created upfront
+        pipe_read = (int*) malloc(n * sizeof(int));
+        pipe_write = (int*) malloc(n * sizeof(int));
+        assert(pipe_read != NULL);
+        assert(pipe_write != NULL);
+
+        int tmp[2];
+        for (int i = 0; i < n; i++) {
             ASSERT_SYS_OK(channel(tmp));
-            dup_fd(tmp[0], get_transfer_read_fd(i, j));
-            dup_fd(tmp[1], get_transfer_write_fd(i, j));
+            pipe_read[i] = park_fd(tmp[0]);
+            pipe_write[i] = park_fd(tmp[1]);
         }
     }
 
@@ -30,8 +158,19 @@ int main(int argc, char* argv[]) {
     char buf[12];
     pid_t pid;
     for (int i = 0; i < n; i++) {
+        if (transport == TRANSPORT_PIPE) {
+            create_channels_of(i, n, pipe_read, pipe_write);
+        }
+
         ASSERT_SYS_OK(pid = fork());
         if (!pid) { // child process
+            if (transport == TRANSPORT_PIPE) {
+                install_channels_of(i, n, pipe_read, pipe_write);
+            }
+            else if (transport == TRANSPORT_MUX) {
+                install_inbound_channels_of(i, n, pipe_read, pipe_write);
+            }
+
             // setting env vars
             sprintf(buf, "%d", i);
             ASSERT_SYS_OK(setenv("MIMPI_WORLD_RANK", buf, 1));
@@ -40,10 +179,27 @@ int main(int argc, char* argv[]) {
             // exec copy
             ASSERT_SYS_OK(execvp(argv[2], argv + 2));
         }
+
+        // closing file descriptors handed over to this copy
+        if (transport == TRANSPORT_PIPE) {
+            release_channels_of(i, n, pipe_read, pipe_write);
+        }
     }
 
-    // closing unnecessary file descriptors (all created above)
-    close_all_transfer_fds(n);
+    // closing unnecessary file descriptors
+    if (transport == TRANSPORT_SHM) {
+        ASSERT_SYS_OK(close(SHM_SEGMENT_FD));
+    }
+    else {
+        if (transport == TRANSPORT_MUX) {
+            for (int i = 0; i < n; i++) {
+                release_fd(pipe_read[i]);
+                release_fd(pipe_write[i]);
+            }
+        }
+        free(pipe_read);
+        free(pipe_write);
+    }
 
     // waiting for all copies
     int ret = 0;
@@ -55,6 +211,10 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    // every copy has written its counters by now
+    stats_summarize(n);
+    trace_merge(n);
+
     return ret;
 
 }
\ No newline at end of file
@@ -0,0 +1,170 @@
+/**
+ * This file is for implementation of the per-rank memory pool.
+ * */
+
+#include "mimpi_common.h"
+#include "pool.h"
+
+// a slab starts with its header, blocks follow keeping 16-byte alignment
+#define SLAB_HEADER ((size_t)1 << POOL_MIN_SHIFT)
+
+// free blocks are threaded through their first bytes
+typedef struct Block {
+    struct Block* next;
+} block_t;
+
+typedef struct Slab {
+    struct Slab* next;
+} slab_t;
+
+// scratch memory, a collective that outgrows the chunk chains a larger one
+typedef struct Chunk {
+    struct Chunk* next;
+    size_t capacity;
+    size_t used;
+} chunk_t;
+
+// the worker allocates payloads that callers free, so the free lists are shared
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static block_t* free_lists[POOL_NUM_CLASSES];
+static slab_t* slabs;
+static chunk_t* scratch;
+static pool_stats_t stats;
+
+static int size_class(size_t size) {
+    if (size <= SLAB_HEADER) return 0;
+    return (int)(8 * sizeof(unsigned long)) - __builtin_clzl(size - 1) - POOL_MIN_SHIFT;
+}
+
+// carve a new slab into blocks of class c (assumes locked mutex)
+static void refill(int c) {
+    size_t block_size = (size_t)1 << (c + POOL_MIN_SHIFT);
+    char* slab = (char*) malloc(POOL_SLAB_SIZE);
+    assert(slab != NULL);
+    ((slab_t*) slab)->next = slabs;
+    slabs = (slab_t*) slab;
+
+    for (size_t offset = SLAB_HEADER; offset + block_size <= POOL_SLAB_SIZE; offset += block_size) {
+        block_t* block = (block_t*) (slab + offset);
+        block->next = free_lists[c];
+        free_lists[c] = block;
+    }
+    stats.slabs++;
+}
+
+void* pool_alloc(size_t size) {
+    if (size > POOL_MAX_BLOCK) {
+        ASSERT_ZERO(pthread_mutex_lock(&pool_mutex));
+        stats.misses++;
+        ASSERT_ZERO(pthread_mutex_unlock(&pool_mutex));
+
+        void* ptr = malloc(size);
+        assert(ptr != NULL);
+        return ptr;
+    }
+
+    int c = size_class(size);
+
+    ASSERT_ZERO(pthread_mutex_lock(&pool_mutex));
+
+    if (free_lists[c] == NULL) {
+        stats.misses++;
+        refill(c);
+    }
+    else {
+        stats.hits++;
+    }
+    block_t* block = free_lists[c];
+    free_lists[c] = block->next;
+
+    ASSERT_ZERO(pthread_mutex_unlock(&pool_mutex));
+
+    return block;
+}
+
+// size must be the one the block was allocated with
+void pool_free(void* ptr, size_t size) {
+    if (size > POOL_MAX_BLOCK) {
+        free(ptr);
+        return;
+    }
+
+    int c = size_class(size);
+    block_t* block = (block_t*) ptr;
+
+    ASSERT_ZERO(pthread_mutex_lock(&pool_mutex));
+
+    block->next = free_lists[c];
+    free_lists[c] = block;
+
+    ASSERT_ZERO(pthread_mutex_unlock(&pool_mutex));
+}
+
+static chunk_t* chunk_create(size_t capacity) {
+    // the header takes a whole alignment unit, so that data stays aligned
+    chunk_t* chunk = (chunk_t*) aligned_alloc(SCRATCH_ALIGN, SCRATCH_ALIGN + capacity);
+    assert(chunk != NULL);
+    chunk->next = NULL;
+    chunk->capacity = capacity;
+    chunk->used = 0;
+    return chunk;
+}
+
+// memory valid until the next scratch_reset (collectives run one at a time)
+void* scratch_alloc(size_t size) {
+    size = (size + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+    if (scratch == NULL || scratch->used + size > scratch->capacity) {
+        size_t capacity = MAX(size, scratch == NULL ? (size_t)POOL_SLAB_SIZE : 2 * scratch->capacity);
+        chunk_t* chunk = chunk_create(capacity);
+        chunk->next = scratch;
+        scratch = chunk;
+
+        ASSERT_ZERO(pthread_mutex_lock(&pool_mutex));
+        stats.scratch_misses++;
+        ASSERT_ZERO(pthread_mutex_unlock(&pool_mutex));
+    }
+
+    void* ptr = (char*) scratch + SCRATCH_ALIGN + scratch->used;
+    scratch->used += size;
+    return ptr;
+}
+
+// called at the start of every collective, chunks chained by the previous one
+// are merged, so that the next one of the same size fits in a single chunk
+void scratch_reset() {
+    if (scratch == NULL) return;
+
+    if (scratch->next != NULL) {
+        size_t capacity = 0;
+        while (scratch != NULL) {
+            chunk_t* next = scratch->next;
+            capacity += scratch->capacity;
+            free(scratch);
+            scratch = next;
+        }
+        scratch = chunk_create(capacity);
+    }
+    scratch->used = 0;
+}
+
+void pool_get_stats(pool_stats_t* out) {
+    ASSERT_ZERO(pthread_mutex_lock(&pool_mutex));
+    *out = stats;
+    ASSERT_ZERO(pthread_mutex_unlock(&pool_mutex));
+}
+
+// MIMPI_Finalize, blocks still handed out must not be used afterwards
+void pool_release() {
+    while (slabs != NULL) {
+        slab_t* next = slabs->next;
+        free(slabs);
+        slabs = next;
+    }
+    while (scratch != NULL) {
+        chunk_t* next = scratch->next;
+        free(scratch);
+        scratch = next;
+    }
+    memset(free_lists, 0, sizeof(free_lists));
+    memset(&stats, 0, sizeof(stats));
+}
@@ -0,0 +1,45 @@
+/**
+ * This file is for declarations of the per-rank memory pool: size-classed
+ * slabs for message nodes, queues, requests and small payloads, and a
+ * reusable scratch arena for collectives. In steady state neither touches
+ * the heap.
+ * */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// block sizes are powers of two from 16 B to 4 KiB, larger payloads go to malloc
+#define POOL_MIN_SHIFT 4
+#define POOL_MAX_SHIFT 12
+#define POOL_NUM_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_MAX_BLOCK ((size_t)1 << POOL_MAX_SHIFT)
+
+#define POOL_SLAB_SIZE (64 * 1024)
+
+// scratch allocations are aligned for vectorized kernels
+#define SCRATCH_ALIGN 64
+
+typedef struct PoolStats {
+    uint64_t hits;           // served from a free list
+    uint64_t misses;         // needed a new slab or malloc
+    uint64_t slabs;
+    uint64_t scratch_misses; // scratch arena had to grow
+} pool_stats_t;
+
+
+void* pool_alloc(size_t size);
+
+void pool_free(void* ptr, size_t size);
+
+void* scratch_alloc(size_t size);
+
+void scratch_reset();
+
+void pool_get_stats(pool_stats_t* stats);
+
+void pool_release();
+
+#endif // POOL_H
@@ -0,0 +1,83 @@
+/**
+ * This file is for implementation of the reduction kernels.
+ * */
+
+#include "mimpi_common.h"
+#include "reduce.h"
+
+// the Makefile builds this file at -O3, which vectorizes the kernels, and on x86-64
+// an AVX2 variant is added that is picked at load time on CPUs that have it
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+#define KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define KERNEL
+#endif
+
+#define DEFINE_KERNEL(name, type, expr)                                            \
+    static KERNEL void name(void* restrict p, const void* restrict u, int count) { \
+        type* restrict partial = (type*) p;                                        \
+        const type* restrict update = (const type*) u;                             \
+        for (int i = 0; i < count; i++) {                                          \
+            partial[i] = expr(partial[i], update[i]);                              \
+        }                                                                          \
+    }
+
+#define DEFINE_ORDER_KERNELS(suffix, type) \
+    DEFINE_KERNEL(max_##suffix, type, MAX) \
+    DEFINE_KERNEL(min_##suffix, type, MIN)
+
+#define DEFINE_ARITHMETIC_KERNELS(suffix, type) \
+    DEFINE_KERNEL(sum_##suffix, type, SUM)      \
+    DEFINE_KERNEL(prod_##suffix, type, PROD)
+
+DEFINE_ORDER_KERNELS(u8, uint8_t)
+DEFINE_ARITHMETIC_KERNELS(u8, uint8_t)
+DEFINE_ORDER_KERNELS(i32, int32_t)
+DEFINE_ORDER_KERNELS(u32, uint32_t)
+DEFINE_ARITHMETIC_KERNELS(u32, uint32_t)
+DEFINE_ORDER_KERNELS(i64, int64_t)
+DEFINE_ORDER_KERNELS(u64, uint64_t)
+DEFINE_ARITHMETIC_KERNELS(u64, uint64_t)
+DEFINE_ORDER_KERNELS(f32, float)
+DEFINE_ARITHMETIC_KERNELS(f32, float)
+DEFINE_ORDER_KERNELS(f64, double)
+DEFINE_ARITHMETIC_KERNELS(f64, double)
+
+typedef void (*kernel_t)(void* restrict, const void* restrict, int);
+
+// indexed by MIMPI_Datatype, then by MIMPI_Op; signed types are added and multiplied
+// as their unsigned counterparts, which wraps around instead of overflowing
+static const kernel_t kernels[][4] = {
+    [MIMPI_UINT8]  = { max_u8,  min_u8,  sum_u8,  prod_u8  },
+    [MIMPI_INT32]  = { max_i32, min_i32, sum_u32, prod_u32 },
+    [MIMPI_UINT32] = { max_u32, min_u32, sum_u32, prod_u32 },
+    [MIMPI_INT64]  = { max_i64, min_i64, sum_u64, prod_u64 },
+    [MIMPI_UINT64] = { max_u64, min_u64, sum_u64, prod_u64 },
+    [MIMPI_FLOAT]  = { max_f32, min_f32, sum_f32, prod_f32 },
+    [MIMPI_DOUBLE] = { max_f64, min_f64, sum_f64, prod_f64 },
+};
+
+static const size_t sizes[] = {
+    [MIMPI_UINT8] = sizeof(uint8_t),
+    [MIMPI_INT32] = sizeof(int32_t),
+    [MIMPI_UINT32] = sizeof(uint32_t),
+    [MIMPI_INT64] = sizeof(int64_t),
+    [MIMPI_UINT64] = sizeof(uint64_t),
+    [MIMPI_FLOAT] = sizeof(float),
+    [MIMPI_DOUBLE] = sizeof(double),
+};
+
+// the tables below are indexed by the arguments as they come from the user
+bool reduction_valid(MIMPI_Datatype datatype, MIMPI_Op op) {
+    return (unsigned) datatype < sizeof(sizes) / sizeof(sizes[0])
+        && (unsigned) op < sizeof(kernels[0]) / sizeof(kernels[0][0]);
+}
+
+size_t datatype_size(MIMPI_Datatype datatype) {
+    return sizes[datatype];
+}
+
+// combine count elements of update into partial (the buffers must not overlap)
+void partially_reduce(void* partial, const void* update, int count, MIMPI_Datatype datatype, MIMPI_Op op) {
+    kernels[datatype][op](partial, update, count);
+}
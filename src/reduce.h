@@ -0,0 +1,19 @@
+/**
+ * This file is for declarations of the reduction kernels used by
+ * MIMPI_Reduce: one loop per (datatype, operation) pair, written so that
+ * the compiler vectorizes it.
+ * */
+
+#ifndef REDUCE_H
+#define REDUCE_H
+
+#include <stddef.h>
+#include "mimpi.h"
+
+bool reduction_valid(MIMPI_Datatype datatype, MIMPI_Op op);
+
+size_t datatype_size(MIMPI_Datatype datatype);
+
+void partially_reduce(void* partial, const void* update, int count, MIMPI_Datatype datatype, MIMPI_Op op);
+
+#endif // REDUCE_H
@@ -0,0 +1,197 @@
+/**
+ * This file is for implementation of the shared-memory transport
+ * (single-producer/single-consumer rings in a memfd segment).
+ * */
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "mimpi_common.h"
+#include "ring.h"
+
+static size_t ring_stride(uint32_t ring_size) {
+    return sizeof(ring_t) + ring_size;
+}
+
+static size_t segment_length(int n, uint32_t ring_size) {
+    return CACHE_LINE + (size_t)n * sizeof(doorbell_t) + (size_t)n * n * ring_stride(ring_size);
+}
+
+// futex words are shared between processes, so the non-private variants are used
+static void futex_wait(atomic_uint* addr, unsigned val) {
+    long ret = syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+    if (ret == -1 && (errno == EAGAIN || errno == EINTR)) return;
+    ASSERT_SYS_OK(ret);
+}
+
+static void futex_wake(atomic_uint* addr) {
+    ASSERT_SYS_OK(syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0));
+}
+
+static ring_t* get_ring(segment_t* seg, int i, int j) {
+    return (ring_t*) (seg->rings + ((size_t)i * seg->n + j) * ring_stride(seg->ring_size));
+}
+
+static char* ring_data(ring_t* ring) {
+    return (char*) (ring + 1);
+}
+
+// mimpirun
+int shm_segment_create(int n, uint32_t ring_size) {
+    // ring positions are free-running 32-bit counters, so size must be a power of two
+    assert(ring_size >= CACHE_LINE && (ring_size & (ring_size - 1)) == 0);
+
+    int fd;
+    ASSERT_SYS_OK(fd = memfd_create("mimpi", 0));
+    size_t length = segment_length(n, ring_size);
+    ASSERT_SYS_OK(ftruncate(fd, length));
+
+    // the rest of the segment is zero-filled by ftruncate
+    segment_header_t header = { .n = n, .ring_size = ring_size };
+    ASSERT_SYS_OK(pwrite(fd, &header, sizeof(header), 0));
+
+    return fd;
+}
+
+// MIMPI_Init
+void shm_segment_attach(segment_t* seg, int fd) {
+    struct stat st;
+    ASSERT_SYS_OK(fstat(fd, &st));
+
+    void* base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) syserr("mmap failed");
+
+    segment_header_t* header = (segment_header_t*) base;
+    seg->base = (char*) base;
+    seg->length = st.st_size;
+    seg->n = header->n;
+    seg->ring_size = header->ring_size;
+    seg->doorbells = (doorbell_t*) (seg->base + CACHE_LINE);
+    seg->rings = (char*) (seg->doorbells + seg->n);
+    assert(seg->length == segment_length(seg->n, seg->ring_size));
+}
+
+// MIMPI_Finalize
+void shm_segment_detach(segment_t* seg) {
+    ASSERT_SYS_OK(munmap(seg->base, seg->length));
+    seg->base = NULL;
+}
+
+// copy as much as fits into ring 'i' -> 'j' without blocking
+size_t ring_write(segment_t* seg, int i, int j, const void* data, size_t count) {
+    ring_t* ring = get_ring(seg, i, j);
+    uint32_t mask = seg->ring_size - 1;
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    size_t n = MIN(count, (size_t)(seg->ring_size - (tail - head)));
+    size_t first = MIN(n, (size_t)(seg->ring_size - (tail & mask)));
+    memcpy(ring_data(ring) + (tail & mask), data, first);
+    memcpy(ring_data(ring), (const char*)data + first, n - first);
+
+    atomic_store_explicit(&ring->tail, tail + (unsigned)n, memory_order_release);
+    return n;
+}
+
+// copy as much as is available from ring 'i' -> 'j' without blocking
+size_t ring_read(segment_t* seg, int i, int j, void* data, size_t count) {
+    ring_t* ring = get_ring(seg, i, j);
+    uint32_t mask = seg->ring_size - 1;
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    size_t n = MIN(count, (size_t)(tail - head));
+    size_t first = MIN(n, (size_t)(seg->ring_size - (head & mask)));
+    memcpy(data, ring_data(ring) + (head & mask), first);
+    memcpy((char*)data + first, ring_data(ring), n - first);
+
+    if (n > 0) {
+        // seq_cst pairs with the producer's store to producer_waiting
+        atomic_store(&ring->head, head + (unsigned)n);
+        if (atomic_load(&ring->producer_waiting)) {
+            atomic_store(&ring->producer_waiting, 0);
+            futex_wake(&ring->head);
+            // a producer's worker waits for space on its own doorbell
+            doorbell_ring(seg, i);
+        }
+    }
+    return n;
+}
+
+size_t ring_readable(segment_t* seg, int i, int j) {
+    ring_t* ring = get_ring(seg, i, j);
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return tail - head;
+}
+
+// true if producer has closed the ring and everything it wrote was consumed
+bool ring_drained(segment_t* seg, int i, int j) {
+    ring_t* ring = get_ring(seg, i, j);
+    if (!atomic_load_explicit(&ring->closed, memory_order_acquire)) return false;
+    return ring_readable(seg, i, j) == 0;
+}
+
+// MIMPI_Finalize (counterpart of closing a pipe's write end)
+void ring_close(segment_t* seg, int i, int j) {
+    atomic_store_explicit(&get_ring(seg, i, j)->closed, 1, memory_order_release);
+    doorbell_ring(seg, j);
+}
+
+void ring_write_full(segment_t* seg, int i, int j, const void* data, size_t count) {
+    ring_t* ring = get_ring(seg, i, j);
+    size_t total_written = 0;
+    while (total_written < count) {
+        size_t written = ring_write(seg, i, j, (const char*)data + total_written, count - total_written);
+        if (written > 0) {
+            total_written += written;
+            doorbell_ring(seg, j);
+            continue;
+        }
+
+        // ring is full, sleep until the consumer moves head
+        unsigned head = atomic_load(&ring->head);
+        atomic_store(&ring->producer_waiting, 1);
+        unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        if (tail - atomic_load(&ring->head) == seg->ring_size) {
+            futex_wait(&ring->head, head);
+        }
+        atomic_store(&ring->producer_waiting, 0);
+    }
+}
+
+// ask the consumer to ring producer 'i' once it frees space,
+// false if the ring is no longer full and writing can be retried
+bool ring_wait_writable(segment_t* seg, int i, int j) {
+    ring_t* ring = get_ring(seg, i, j);
+    atomic_store(&ring->producer_waiting, 1);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load(&ring->head) == seg->ring_size) return true;
+    atomic_store(&ring->producer_waiting, 0);
+    return false;
+}
+
+unsigned doorbell_seq(segment_t* seg, int j) {
+    return atomic_load(&seg->doorbells[j].seq);
+}
+
+void doorbell_ring(segment_t* seg, int j) {
+    doorbell_t* bell = &seg->doorbells[j];
+    atomic_fetch_add(&bell->seq, 1);
+    if (atomic_load(&bell->sleeping)) {
+        futex_wake(&bell->seq);
+    }
+}
+
+// sleep until receiver 'j' is rung after 'seen' was read
+void doorbell_wait(segment_t* seg, int j, unsigned seen) {
+    doorbell_t* bell = &seg->doorbells[j];
+    atomic_store(&bell->sleeping, 1);
+    if (atomic_load(&bell->seq) == seen) {
+        futex_wait(&bell->seq, seen);
+    }
+    atomic_store(&bell->sleeping, 0);
+}
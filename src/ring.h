@@ -0,0 +1,80 @@
+/**
+ * This file is for declarations of the shared-memory transport used when
+ * MIMPI_TRANSPORT=shm. mimpirun creates one anonymous memory segment with
+ * a single-producer/single-consumer byte ring for every (sender, receiver)
+ * pair and a doorbell for every receiver; all ranks inherit and map it.
+ * */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_LINE 64
+
+// descriptor under which mimpirun passes the segment to ranks
+#define SHM_SEGMENT_FD 1023
+
+#define DEFAULT_RING_SIZE (64 * 1024)
+
+// per-receiver wake-up word, bumped by every producer after publishing data
+typedef struct Doorbell {
+    _Alignas(CACHE_LINE) atomic_uint seq;
+    atomic_uint sleeping;
+} doorbell_t;
+
+// head is only written by the consumer and tail only by the producer,
+// so they live on separate cache lines
+typedef struct Ring {
+    _Alignas(CACHE_LINE) atomic_uint head;
+    atomic_uint producer_waiting;
+    _Alignas(CACHE_LINE) atomic_uint tail;
+    atomic_uint closed;
+} ring_t;
+
+typedef struct SegmentHeader {
+    uint32_t n;
+    uint32_t ring_size;
+} segment_header_t;
+
+// process-local view of a mapped segment
+typedef struct Segment {
+    char* base;
+    size_t length;
+    int n;
+    uint32_t ring_size;
+    doorbell_t* doorbells;
+    char* rings;
+} segment_t;
+
+
+int shm_segment_create(int n, uint32_t ring_size);
+
+void shm_segment_attach(segment_t* seg, int fd);
+
+void shm_segment_detach(segment_t* seg);
+
+size_t ring_write(segment_t* seg, int i, int j, const void* data, size_t count);
+
+size_t ring_read(segment_t* seg, int i, int j, void* data, size_t count);
+
+size_t ring_readable(segment_t* seg, int i, int j);
+
+bool ring_drained(segment_t* seg, int i, int j);
+
+void ring_close(segment_t* seg, int i, int j);
+
+void ring_write_full(segment_t* seg, int i, int j, const void* data, size_t count);
+
+bool ring_wait_writable(segment_t* seg, int i, int j);
+
+unsigned doorbell_seq(segment_t* seg, int j);
+
+void doorbell_ring(segment_t* seg, int j);
+
+void doorbell_wait(segment_t* seg, int j, unsigned seen);
+
+#endif // RING_H
@@ -0,0 +1,360 @@
+/**
+ * This file is for implementation of the per-rank performance counters.
+ * */
+
+#include <inttypes.h>
+#include "mimpi_common.h"
+#include "pool.h"
+#include "stats.h"
+
+typedef struct Histogram {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[STATS_BUCKETS];
+} histogram_t;
+
+typedef struct Traffic {
+    uint64_t sent_msgs;
+    uint64_t sent_bytes;
+    uint64_t recv_msgs;
+    uint64_t recv_bytes;
+    histogram_t wait; // time callers slept until a request completed
+} traffic_t;
+
+typedef struct PeerStats {
+    traffic_t traffic;
+    uint64_t buffered;      // messages from the peer buffered unexpected
+    uint64_t buffered_hwm;
+    uint64_t credit_stalls; // sends to the peer that had to wait for credits
+} peer_stats_t;
+
+typedef struct Stats {
+    uint64_t rank;
+    uint64_t size;
+    peer_stats_t* peers;
+    traffic_t tags[NUM_TAG_CLASSES];
+    histogram_t collectives[NUM_TAG_CLASSES]; // only collective classes are used
+    pool_stats_t pool;                        // taken from the pool in MIMPI_Finalize
+} stats_t;
+
+static const char* tag_class_names[NUM_TAG_CLASSES] = {
+    [TAG_CLASS_USER] = "user",
+    [TAG_CLASS_BARRIER] = "barrier",
+    [TAG_CLASS_BCAST] = "bcast",
+    [TAG_CLASS_REDUCE] = "reduce",
+    [TAG_CLASS_ALLREDUCE] = "allreduce",
+    [TAG_CLASS_GATHER] = "gather",
+    [TAG_CLASS_SCATTER] = "scatter",
+    [TAG_CLASS_ALLGATHER] = "allgather",
+    [TAG_CLASS_ALLTOALL] = "alltoall",
+    [TAG_CLASS_RNDV] = "rndv",
+    [TAG_CLASS_CONTROL] = "control",
+};
+
+static bool enabled;
+static const char* directory;
+static stats_t stats;
+
+// counters are bumped by application threads and the worker without a common lock
+#define ADD(counter, value) __atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+
+static void update_max(uint64_t* max, uint64_t value) {
+    uint64_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (value > old && !__atomic_compare_exchange_n(max, &old, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static tag_class_t tag_class(int tag) {
+    if (tag >= 0) return TAG_CLASS_USER;
+    switch (tag) {
+        case BARRIER_TAG: return TAG_CLASS_BARRIER;
+        case BCAST_TAG: return TAG_CLASS_BCAST;
+        case REDUCE_TAG: return TAG_CLASS_REDUCE;
+        case ALLREDUCE_TAG: return TAG_CLASS_ALLREDUCE;
+        case GATHER_TAG: return TAG_CLASS_GATHER;
+        case SCATTER_TAG: return TAG_CLASS_SCATTER;
+        case ALLGATHER_TAG: return TAG_CLASS_ALLGATHER;
+        case ALLTOALL_TAG: return TAG_CLASS_ALLTOALL;
+        case RNDV_DATA_TAG: return TAG_CLASS_RNDV;
+        default: return TAG_CLASS_CONTROL;
+    }
+}
+
+static bool is_collective(tag_class_t class) {
+    return class != TAG_CLASS_USER && class != TAG_CLASS_RNDV && class != TAG_CLASS_CONTROL;
+}
+
+static void record(histogram_t* histogram, uint64_t ns) {
+    int bucket = 0;
+    while (bucket < STATS_BUCKETS - 1 && ns >> (bucket + 1) != 0) bucket++;
+    ADD(histogram->count, 1);
+    ADD(histogram->total_ns, ns);
+    ADD(histogram->buckets[bucket], 1);
+    update_max(&histogram->max_ns, ns);
+}
+
+// MIMPI_Init
+void stats_init(int rank, int size) {
+    directory = getenv(STATS_VAR);
+    enabled = directory != NULL && *directory != '\0';
+    if (!enabled) return;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.rank = rank;
+    stats.size = size;
+    stats.peers = (peer_stats_t*) calloc(size, sizeof(peer_stats_t));
+    assert(stats.peers != NULL);
+}
+
+// 0 when disabled, so that callers pay for the clock only when the result is recorded
+uint64_t stats_clock() {
+    return enabled ? monotonic_ns() : 0;
+}
+
+// a message to peer was started, including control messages
+void stats_sent(int peer, int tag, int count) {
+    if (!enabled) return;
+
+    traffic_t* traffic[2] = { &stats.peers[peer].traffic, &stats.tags[tag_class(tag)] };
+    for (int i = 0; i < 2; i++) {
+        ADD(traffic[i]->sent_msgs, 1);
+        ADD(traffic[i]->sent_bytes, count);
+    }
+}
+
+// a message from peer has arrived in full
+void stats_received(int peer, int tag, int count) {
+    if (!enabled) return;
+
+    traffic_t* traffic[2] = { &stats.peers[peer].traffic, &stats.tags[tag_class(tag)] };
+    for (int i = 0; i < 2; i++) {
+        ADD(traffic[i]->recv_msgs, 1);
+        ADD(traffic[i]->recv_bytes, count);
+    }
+}
+
+// a message from peer was buffered unexpected (1) or taken from the buffer (-1)
+// (assumes locked peer_mutex[peer])
+void stats_buffered(int peer, int delta) {
+    if (!enabled) return;
+
+    peer_stats_t* p = &stats.peers[peer];
+    p->buffered += delta;
+    p->buffered_hwm = MAX(p->buffered_hwm, p->buffered);
+}
+
+// a send to peer found too few credits and waits for them (assumes locked peer_mutex[peer])
+void stats_credit_stall(int peer) {
+    if (!enabled) return;
+
+    stats.peers[peer].credit_stalls++;
+}
+
+// a request with peer slept since start
+void stats_wait(int peer, int tag, uint64_t start) {
+    if (!enabled) return;
+
+    uint64_t ns = stats_clock() - start;
+    record(&stats.peers[peer].traffic.wait, ns);
+    record(&stats.tags[tag_class(tag)].wait, ns);
+}
+
+// a collective with the given tag took since start
+void stats_collective(int tag, uint64_t start) {
+    if (!enabled) return;
+
+    record(&stats.collectives[tag_class(tag)], stats_clock() - start);
+}
+
+// the same code writes and reads a file: keys have no digits, so on reading
+// every value is just the next number in the file
+typedef struct Walker {
+    FILE* file;
+    bool reading;
+    bool first; // no comma before the next item
+} walker_t;
+
+static void item(walker_t* w, const char* key) {
+    if (!w->first) fputc(',', w->file);
+    w->first = false;
+    if (key != NULL) fprintf(w->file, "\"%s\":", key);
+}
+
+static void open_bracket(walker_t* w, const char* key, char bracket) {
+    if (w->reading) return;
+    item(w, key);
+    fputc(bracket, w->file);
+    w->first = true;
+}
+
+static void close_bracket(walker_t* w, char bracket) {
+    if (w->reading) return;
+    fputc(bracket, w->file);
+    w->first = false;
+}
+
+static void walk_number(walker_t* w, const char* key, uint64_t* value) {
+    if (!w->reading) {
+        item(w, key);
+        fprintf(w->file, "%" PRIu64, *value);
+        return;
+    }
+    int c;
+    while ((c = fgetc(w->file)) != EOF && (c < '0' || c > '9')) {
+    }
+    if (c == EOF || ungetc(c, w->file) == EOF || fscanf(w->file, "%" SCNu64, value) != 1) {
+        fatal("malformed %s file", STATS_VAR);
+    }
+}
+
+static void walk_histogram(walker_t* w, const char* key, histogram_t* histogram) {
+    open_bracket(w, key, '{');
+    walk_number(w, "count", &histogram->count);
+    walk_number(w, "total_ns", &histogram->total_ns);
+    walk_number(w, "max_ns", &histogram->max_ns);
+    open_bracket(w, "buckets", '[');
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        walk_number(w, NULL, &histogram->buckets[i]);
+    }
+    close_bracket(w, ']');
+    close_bracket(w, '}');
+}
+
+static void walk_traffic(walker_t* w, traffic_t* traffic) {
+    walk_number(w, "sent_msgs", &traffic->sent_msgs);
+    walk_number(w, "sent_bytes", &traffic->sent_bytes);
+    walk_number(w, "recv_msgs", &traffic->recv_msgs);
+    walk_number(w, "recv_bytes", &traffic->recv_bytes);
+    walk_histogram(w, "wait", &traffic->wait);
+}
+
+// peers of a summary are indexed by the rank traffic went to and came from;
+// on reading s->size is the number of peers allocated, false if the file has another
+// (nothing after the size is read then)
+static bool walk_stats(walker_t* w, stats_t* s, const char* rank_key) {
+    open_bracket(w, NULL, '{');
+    walk_number(w, rank_key, &s->rank);
+    uint64_t size = s->size;
+    walk_number(w, "size", &size);
+    if (size != s->size) return false;
+
+    open_bracket(w, "peers", '[');
+    for (uint64_t i = 0; i < s->size; i++) {
+        open_bracket(w, NULL, '{');
+        walk_traffic(w, &s->peers[i].traffic);
+        walk_number(w, "buffered_hwm", &s->peers[i].buffered_hwm);
+        walk_number(w, "credit_stalls", &s->peers[i].credit_stalls);
+        close_bracket(w, '}');
+    }
+    close_bracket(w, ']');
+
+    open_bracket(w, "tags", '{');
+    for (int c = 0; c < NUM_TAG_CLASSES; c++) {
+        open_bracket(w, tag_class_names[c], '{');
+        walk_traffic(w, &s->tags[c]);
+        close_bracket(w, '}');
+    }
+    close_bracket(w, '}');
+
+    open_bracket(w, "collectives", '{');
+    for (int c = 0; c < NUM_TAG_CLASSES; c++) {
+        if (is_collective(c)) walk_histogram(w, tag_class_names[c], &s->collectives[c]);
+    }
+    close_bracket(w, '}');
+
+    open_bracket(w, "pool", '{');
+    walk_number(w, "hits", &s->pool.hits);
+    walk_number(w, "misses", &s->pool.misses);
+    walk_number(w, "slabs", &s->pool.slabs);
+    walk_number(w, "scratch_misses", &s->pool.scratch_misses);
+    close_bracket(w, '}');
+    close_bracket(w, '}');
+
+    if (!w->reading) fputc('\n', w->file);
+    return true;
+}
+
+// MIMPI_Finalize
+void stats_finalize() {
+    if (!enabled) return;
+
+    char name[32];
+    snprintf(name, sizeof(name), "rank-%" PRIu64 ".json", stats.rank);
+    FILE* file = open_in_dir(directory, name, "w");
+    if (file == NULL) syserr("cannot write %s/%s", directory, name);
+
+    pool_get_stats(&stats.pool);
+    walk_stats(&(walker_t) { file, false, true }, &stats, "rank");
+    ASSERT_ZERO(fclose(file));
+
+    free(stats.peers);
+    enabled = false;
+}
+
+static void merge_histogram(histogram_t* to, const histogram_t* from) {
+    to->count += from->count;
+    to->total_ns += from->total_ns;
+    to->max_ns = MAX(to->max_ns, from->max_ns);
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        to->buckets[i] += from->buckets[i];
+    }
+}
+
+static void merge_traffic(traffic_t* to, const traffic_t* from) {
+    to->sent_msgs += from->sent_msgs;
+    to->sent_bytes += from->sent_bytes;
+    to->recv_msgs += from->recv_msgs;
+    to->recv_bytes += from->recv_bytes;
+    merge_histogram(&to->wait, &from->wait);
+}
+
+// mimpirun, after all copies have exited: counters of all ranks summed (maxima taken),
+// the ones that did not get to MIMPI_Finalize are left out
+void stats_summarize(int size) {
+    const char* dir = getenv(STATS_VAR);
+    if (dir == NULL || *dir == '\0') return;
+
+    stats_t summary = { .size = size };
+    stats_t rank_stats = { .size = size };
+    summary.peers = (peer_stats_t*) calloc(size, sizeof(peer_stats_t));
+    rank_stats.peers = (peer_stats_t*) calloc(size, sizeof(peer_stats_t));
+    assert(summary.peers != NULL);
+    assert(rank_stats.peers != NULL);
+
+    for (int r = 0; r < size; r++) {
+        char name[32];
+        snprintf(name, sizeof(name), "rank-%d.json", r);
+        FILE* file = open_in_dir(dir, name, "r");
+        if (file == NULL) continue;
+
+        if (!walk_stats(&(walker_t) { file, true, true }, &rank_stats, "rank")) {
+            fatal("%s/%s is from a run with another size", dir, name);
+        }
+        ASSERT_ZERO(fclose(file));
+        summary.rank++;
+
+        for (int i = 0; i < size; i++) {
+            merge_traffic(&summary.peers[i].traffic, &rank_stats.peers[i].traffic);
+            summary.peers[i].buffered_hwm = MAX(summary.peers[i].buffered_hwm, rank_stats.peers[i].buffered_hwm);
+            summary.peers[i].credit_stalls += rank_stats.peers[i].credit_stalls;
+        }
+        for (int c = 0; c < NUM_TAG_CLASSES; c++) {
+            merge_traffic(&summary.tags[c], &rank_stats.tags[c]);
+            merge_histogram(&summary.collectives[c], &rank_stats.collectives[c]);
+        }
+        summary.pool.hits += rank_stats.pool.hits;
+        summary.pool.misses += rank_stats.pool.misses;
+        summary.pool.slabs += rank_stats.pool.slabs;
+        summary.pool.scratch_misses += rank_stats.pool.scratch_misses;
+    }
+
+    FILE* file = open_in_dir(dir, "summary.json", "w");
+    if (file == NULL) syserr("cannot write %s/summary.json", dir);
+    // rank holds the number of ranks that were merged
+    walk_stats(&(walker_t) { file, false, true }, &summary, "ranks");
+    ASSERT_ZERO(fclose(file));
+
+    free(summary.peers);
+    free(rank_stats.peers);
+}
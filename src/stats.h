@@ -0,0 +1,57 @@
+/**
+ * This file is for declarations of the per-rank performance counters:
+ * messages and bytes per peer and per tag class, depth of the unexpected
+ * message buffers, sends that waited for credits, memory pool use, and
+ * latency histograms of waits and collectives.
+ * Enabled by MIMPI_STATS=<directory>, every rank writes rank-<rank>.json
+ * there in MIMPI_Finalize, and mimpirun merges them into summary.json.
+ * */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define STATS_VAR "MIMPI_STATS"
+
+// bucket i counts durations of [2^i, 2^(i+1)) ns, the last one everything longer
+#define STATS_BUCKETS 32
+
+// tags are counted by what they are used for, collectives by their tag
+typedef enum {
+    TAG_CLASS_USER,
+    TAG_CLASS_BARRIER,
+    TAG_CLASS_BCAST,
+    TAG_CLASS_REDUCE,
+    TAG_CLASS_ALLREDUCE,
+    TAG_CLASS_GATHER,
+    TAG_CLASS_SCATTER,
+    TAG_CLASS_ALLGATHER,
+    TAG_CLASS_ALLTOALL,
+    TAG_CLASS_RNDV,    // data of rendezvous sends, once CTS has arrived
+    TAG_CLASS_CONTROL, // RTS, CTS, credits, deadlock detection
+    NUM_TAG_CLASSES,
+} tag_class_t;
+
+void stats_init(int rank, int size);
+
+void stats_finalize();
+
+uint64_t stats_clock();
+
+void stats_sent(int peer, int tag, int count);
+
+void stats_received(int peer, int tag, int count);
+
+void stats_buffered(int peer, int delta);
+
+void stats_credit_stall(int peer);
+
+void stats_wait(int peer, int tag, uint64_t start);
+
+void stats_collective(int tag, uint64_t start);
+
+void stats_summarize(int size);
+
+#endif // STATS_H
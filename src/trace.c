@@ -0,0 +1,254 @@
+/**
+ * This file is for implementation of the timeline tracer.
+ * */
+
+#include <inttypes.h>
+#include "mimpi_common.h"
+#include "trace.h"
+
+typedef struct TraceEvent {
+    uint64_t ts;   // ns, CLOCK_MONOTONIC is shared by all processes
+    uint64_t dur;  // ns, of a complete event
+    uint64_t flow; // message id, 0 if none
+    int32_t tid;
+    int32_t peer;
+    int32_t tag;
+    int32_t count;
+    int16_t type;
+    char phase;    // 'B', 'E', 'X' (complete) or 'M' (thread name)
+    char flow_phase; // 's' at the writer, 'f' at the reader
+    uint32_t seq;  // position + 1 in the ring once the event is filled in
+} trace_event_t;
+
+typedef struct TraceHeader {
+    uint64_t rank;
+    uint64_t num_events;
+    uint64_t dropped;
+} trace_header_t;
+
+static const char* type_names[NUM_TRACE_TYPES] = {
+    [TRACE_SEND] = "MIMPI_Send",
+    [TRACE_RECV] = "MIMPI_Recv",
+    [TRACE_WRITE] = "write",
+    [TRACE_ARRIVE] = "arrive",
+    [TRACE_BARRIER] = "MIMPI_Barrier",
+    [TRACE_BCAST] = "MIMPI_Bcast",
+    [TRACE_REDUCE] = "MIMPI_Reduce",
+    [TRACE_ALLREDUCE] = "MIMPI_Allreduce",
+    [TRACE_GATHER] = "MIMPI_Gather",
+    [TRACE_SCATTER] = "MIMPI_Scatter",
+    [TRACE_ALLGATHER] = "MIMPI_Allgather",
+    [TRACE_ALLTOALL] = "MIMPI_Alltoall",
+    [TRACE_ROUND] = "round",
+    [TRACE_READY] = "ready",
+    [TRACE_DATA] = "data",
+    [TRACE_REDUCE_SCATTER] = "reduce-scatter",
+    [TRACE_SHARE] = "allgather",
+    [TRACE_WORKER] = "worker",
+};
+
+static bool enabled;
+static const char* directory;
+static int my_rank;
+static trace_event_t* events;
+static uint64_t capacity; // a power of two
+static uint64_t head;     // events ever recorded, taken with an atomic increment
+
+static int next_tid;
+static __thread int this_tid = -1;
+
+// MIMPI_Init
+void trace_init(int rank) {
+    directory = getenv(TRACE_VAR);
+    enabled = directory != NULL && *directory != '\0';
+    if (!enabled) return;
+
+    const char* events_str = getenv(TRACE_EVENTS_VAR);
+    uint64_t requested = events_str != NULL ? strtoull(events_str, NULL, 10) : DEFAULT_TRACE_EVENTS;
+    for (capacity = 1; capacity < requested; capacity *= 2) {
+    }
+
+    my_rank = rank;
+    head = 0;
+    events = (trace_event_t*) calloc(capacity, sizeof(trace_event_t));
+    assert(events != NULL);
+}
+
+bool trace_enabled() {
+    return enabled;
+}
+
+// the start passed to trace_message; taken for every message, so it skips the clock while tracing is off
+uint64_t trace_clock() {
+    return enabled ? monotonic_ns() : 0;
+}
+
+// threads are numbered in the order they record their first event
+static int thread_id() {
+    if (this_tid == -1) this_tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+    return this_tid;
+}
+
+// application threads and the worker record without a lock: each takes its own slot,
+// and publishes the event by storing its sequence number last
+static void record(trace_event_t event) {
+    uint64_t position = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+    trace_event_t* slot = &events[position & (capacity - 1)];
+
+    event.tid = thread_id();
+    event.seq = 0;
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    *slot = event;
+    __atomic_store_n(&slot->seq, (uint32_t) (position + 1), __ATOMIC_RELEASE);
+}
+
+void trace_begin(trace_type_t type, int peer, int tag, int count) {
+    if (!enabled) return;
+
+    record((trace_event_t) { .ts = trace_clock(), .type = type, .phase = 'B', .peer = peer, .tag = tag, .count = count });
+}
+
+void trace_end(trace_type_t type) {
+    if (!enabled) return;
+
+    record((trace_event_t) { .ts = trace_clock(), .type = type, .phase = 'E', .peer = -1 });
+}
+
+// a message written to peer (TRACE_WRITE) or read from it (TRACE_ARRIVE) since start
+void trace_message(trace_type_t type, uint64_t start, int peer, int tag, int count, uint64_t flow) {
+    if (!enabled) return;
+
+    record((trace_event_t) {
+        .ts = start, .dur = trace_clock() - start, .flow = flow, .type = type, .phase = 'X',
+        .flow_phase = type == TRACE_WRITE ? 's' : 'f', .peer = peer, .tag = tag, .count = count,
+    });
+}
+
+// names the calling thread in the trace
+void trace_thread(trace_type_t type) {
+    if (!enabled) return;
+
+    record((trace_event_t) { .ts = trace_clock(), .type = type, .phase = 'M', .peer = -1 });
+}
+
+// the seq-th message on channel source -> destination, both ends count messages in channel order
+uint64_t trace_flow_id(int source, int destination, uint32_t seq) {
+    return ((uint64_t) (source * MAX_WORLD_SIZE + destination) << 32) | seq;
+}
+
+// MIMPI_Finalize, after the worker has stopped
+void trace_finalize() {
+    if (!enabled) return;
+
+    char name[32];
+    snprintf(name, sizeof(name), "trace-%d.bin", my_rank);
+    FILE* file = open_in_dir(directory, name, "w");
+    if (file == NULL) syserr("cannot write %s/%s", directory, name);
+
+    // only the last capacity events are still in the ring, in order from the oldest,
+    // a slot whose writer was lapped by another one is left out
+    uint64_t first = head > capacity ? head - capacity : 0;
+    trace_header_t header = { .rank = my_rank, .num_events = 0, .dropped = first };
+    trace_event_t* ordered = (trace_event_t*) malloc((head - first + 1) * sizeof(trace_event_t));
+    assert(ordered != NULL);
+    for (uint64_t position = first; position < head; position++) {
+        trace_event_t* event = &events[position & (capacity - 1)];
+        if (event->seq == (uint32_t) (position + 1)) ordered[header.num_events++] = *event;
+    }
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(ordered, sizeof(trace_event_t), header.num_events, file) != header.num_events) {
+        syserr("cannot write %s/%s", directory, name);
+    }
+    ASSERT_ZERO(fclose(file));
+
+    free(ordered);
+    free(events);
+    enabled = false;
+}
+
+static void write_event(FILE* out, bool* first, int rank, const trace_event_t* e, uint64_t origin) {
+    double ts = (double) (e->ts - origin) / 1e3;
+    fprintf(out, "%s\n{\"pid\":%d,\"tid\":%d,\"ts\":%.3f,", *first ? "" : ",", rank, e->tid, ts);
+    *first = false;
+
+    if (e->phase == 'M') {
+        fprintf(out, "\"ph\":\"M\",\"name\":\"thread_name\",\"args\":{\"name\":\"%s\"}}", type_names[e->type]);
+        return;
+    }
+    fprintf(out, "\"ph\":\"%c\",\"name\":\"%s\"", e->phase, type_names[e->type]);
+    if (e->phase == 'X') fprintf(out, ",\"dur\":%.3f", (double) e->dur / 1e3);
+    if (e->phase != 'E') fprintf(out, ",\"args\":{\"peer\":%d,\"tag\":%d,\"count\":%d}", e->peer, e->tag, e->count);
+    fputc('}', out);
+
+    // the arrow starts in the write and ends in the read of the same message
+    if (e->flow != 0) {
+        fprintf(out, ",\n{\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"ph\":\"%c\",\"name\":\"message\",\"cat\":\"message\",\"id\":%" PRIu64 "%s}",
+                rank, e->tid, ts, e->flow_phase, e->flow, e->flow_phase == 'f' ? ",\"bp\":\"e\"" : "");
+    }
+}
+
+static trace_event_t* load(const char* dir, int rank, trace_header_t* header) {
+    char name[32];
+    snprintf(name, sizeof(name), "trace-%d.bin", rank);
+    FILE* file = open_in_dir(dir, name, "r");
+    if (file == NULL) return NULL;
+
+    trace_event_t* loaded = NULL;
+    if (fread(header, sizeof(*header), 1, file) == 1) {
+        loaded = (trace_event_t*) malloc(MAX(header->num_events, 1) * sizeof(trace_event_t));
+        assert(loaded != NULL);
+        if (fread(loaded, sizeof(trace_event_t), header->num_events, file) != header->num_events) {
+            fatal("%s/%s is truncated", dir, name);
+        }
+    }
+    ASSERT_ZERO(fclose(file));
+    return loaded;
+}
+
+// mimpirun, after all copies have exited: one process per rank, timestamps relative
+// to the earliest event; ranks that did not get to MIMPI_Finalize are left out
+void trace_merge(int size) {
+    const char* dir = getenv(TRACE_VAR);
+    if (dir == NULL || *dir == '\0') return;
+
+    trace_header_t* headers = (trace_header_t*) calloc(size, sizeof(trace_header_t));
+    trace_event_t** loaded = (trace_event_t**) calloc(size, sizeof(trace_event_t*));
+    assert(headers != NULL);
+    assert(loaded != NULL);
+
+    uint64_t origin = UINT64_MAX;
+    for (int r = 0; r < size; r++) {
+        loaded[r] = load(dir, r, &headers[r]);
+        for (uint64_t i = 0; loaded[r] != NULL && i < headers[r].num_events; i++) {
+            origin = MIN(origin, loaded[r][i].ts);
+        }
+    }
+
+    FILE* out = open_in_dir(dir, "trace.json", "w");
+    if (out == NULL) syserr("cannot write %s/trace.json", dir);
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    bool first = true;
+    for (int r = 0; r < size; r++) {
+        if (loaded[r] == NULL) continue;
+        fprintf(out, "%s\n{\"pid\":%d,\"ph\":\"M\",\"name\":\"process_name\",\"args\":{\"name\":\"rank %d\"}}",
+                first ? "" : ",", r, r);
+        fprintf(out, ",\n{\"pid\":%d,\"ph\":\"M\",\"name\":\"process_sort_index\",\"args\":{\"sort_index\":%d}}", r, r);
+        first = false;
+        for (uint64_t i = 0; i < headers[r].num_events; i++) {
+            write_event(out, &first, r, &loaded[r][i], origin);
+        }
+        if (headers[r].dropped > 0) {
+            fprintf(stderr, "%s: rank %d dropped its %" PRIu64 " oldest events, raise %s\n",
+                    TRACE_VAR, r, headers[r].dropped, TRACE_EVENTS_VAR);
+        }
+        free(loaded[r]);
+    }
+    fprintf(out, "\n]}\n");
+    ASSERT_ZERO(fclose(out));
+
+    free(headers);
+    free(loaded);
+}
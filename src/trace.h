@@ -0,0 +1,64 @@
+/**
+ * This file is for declarations of the timeline tracer. Enabled by
+ * MIMPI_TRACE=<directory>, every rank records timestamped events into a
+ * lock-free ring, writes it to trace-<rank>.bin there in MIMPI_Finalize,
+ * and mimpirun merges all of them into trace.json, which chrome://tracing
+ * and Perfetto open. Messages are drawn as arrows from the rank that
+ * wrote them to the rank that read them.
+ * */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRACE_VAR "MIMPI_TRACE"
+#define TRACE_EVENTS_VAR "MIMPI_TRACE_EVENTS"
+
+// events kept per rank, older ones are overwritten
+#define DEFAULT_TRACE_EVENTS (1 << 16)
+
+typedef enum {
+    TRACE_SEND,
+    TRACE_RECV,
+    TRACE_WRITE,   // a message starts being written to its channel
+    TRACE_ARRIVE,  // the worker reads a message, from its header to its last byte
+    TRACE_BARRIER,
+    TRACE_BCAST,
+    TRACE_REDUCE,
+    TRACE_ALLREDUCE,
+    TRACE_GATHER,
+    TRACE_SCATTER,
+    TRACE_ALLGATHER,
+    TRACE_ALLTOALL,
+    TRACE_ROUND,   // one exchange of MIMPI_Barrier
+    TRACE_READY,   // MIMPI_Bcast waiting for its subtree
+    TRACE_DATA,    // MIMPI_Bcast passing data down
+    TRACE_REDUCE_SCATTER, // first half of the ring MIMPI_Allreduce
+    TRACE_SHARE,   // second half of the ring MIMPI_Allreduce
+    TRACE_WORKER,  // names the worker thread
+    NUM_TRACE_TYPES,
+} trace_type_t;
+
+void trace_init(int rank);
+
+void trace_finalize();
+
+bool trace_enabled();
+
+uint64_t trace_clock();
+
+void trace_begin(trace_type_t type, int peer, int tag, int count);
+
+void trace_end(trace_type_t type);
+
+void trace_message(trace_type_t type, uint64_t start, int peer, int tag, int count, uint64_t flow);
+
+void trace_thread(trace_type_t type);
+
+uint64_t trace_flow_id(int source, int destination, uint32_t seq);
+
+void trace_merge(int size);
+
+#endif // TRACE_H
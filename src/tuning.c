@@ -0,0 +1,140 @@
+/**
+ * This file is for implementation of the collective algorithm selection.
+ * */
+
+#include "mimpi_common.h"
+#include "tuning.h"
+
+typedef struct Rule {
+    collective_t collective;
+    int ranks;    // applies to this many processes or more
+    size_t bytes; // and to messages of this size or larger
+    int algorithm;
+} rule_t;
+
+static const char* collective_names[NUM_COLLECTIVES] = {
+    [COLL_BCAST] = "bcast",
+    [COLL_ALLREDUCE] = "allreduce",
+    [COLL_GATHER] = "gather",
+    [COLL_SCATTER] = "scatter",
+    [COLL_ALLGATHER] = "allgather",
+};
+
+#define MAX_ALGORITHMS 2
+
+static const char* algorithm_names[NUM_COLLECTIVES][MAX_ALGORITHMS] = {
+    [COLL_BCAST] = { "binomial", "chain" },
+    [COLL_ALLREDUCE] = { "doubling", "ring" },
+    [COLL_GATHER] = { "binomial", "linear" },
+    [COLL_SCATTER] = { "binomial", "linear" },
+    [COLL_ALLGATHER] = { "ring", "gather_bcast" },
+};
+
+// used when there is no tuning file, or it says nothing about the given case
+static const rule_t default_rules[] = {
+    { COLL_BCAST, 1, BCAST_CHAIN_MIN, BCAST_CHAIN },
+    { COLL_ALLREDUCE, 1, ALLREDUCE_RING_MIN, ALLREDUCE_RING },
+};
+
+#define NUM_DEFAULT_RULES (sizeof(default_rules) / sizeof(rule_t))
+
+static rule_t* rules;
+static int num_rules;
+static int forced[NUM_COLLECTIVES];
+
+static void add_rule(rule_t rule) {
+    // grows by powers of two
+    if ((num_rules & (num_rules - 1)) == 0) {
+        rules = (rule_t*) realloc(rules, (num_rules == 0 ? 1 : 2 * num_rules) * sizeof(rule_t));
+        assert(rules != NULL);
+    }
+    rules[num_rules++] = rule;
+}
+
+static int find_name(const char* const* names, int n, const char* name) {
+    for (int i = 0; i < n; i++) {
+        if (names[i] != NULL && strcmp(names[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+// every line is "collective ranks bytes algorithm", # starts a comment
+static void load_file(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) syserr("cannot open tuning file %s", path);
+
+    char line[256];
+    for (int number = 1; fgets(line, sizeof(line), file) != NULL; number++) {
+        char* comment = strchr(line, '#');
+        if (comment != NULL) *comment = '\0';
+
+        char collective[32], algorithm[32];
+        int ranks;
+        unsigned long long bytes;
+        int fields = sscanf(line, "%31s %d %llu %31s", collective, &ranks, &bytes, algorithm);
+        if (fields <= 0) continue;
+        if (fields != 4) fatal("%s:%d: expected \"collective ranks bytes algorithm\"", path, number);
+
+        int c = find_name(collective_names, NUM_COLLECTIVES, collective);
+        if (c < 0) fatal("%s:%d: unknown collective %s", path, number, collective);
+        int a = find_name(algorithm_names[c], MAX_ALGORITHMS, algorithm);
+        if (a < 0) fatal("%s:%d: unknown %s algorithm %s", path, number, collective, algorithm);
+        add_rule((rule_t) { c, ranks, bytes, a });
+    }
+    fclose(file);
+}
+
+// MIMPI_Init, every process reads the same table, so all of them pick the same algorithms
+void tuning_load() {
+    for (int c = 0; c < NUM_COLLECTIVES; c++) {
+        forced[c] = -1;
+    }
+    for (size_t i = 0; i < NUM_DEFAULT_RULES; i++) {
+        add_rule(default_rules[i]);
+    }
+
+    const char* path = getenv(TUNING_VAR);
+    if (path != NULL && *path != '\0') load_file(path);
+}
+
+// MIMPI_Finalize
+void tuning_release() {
+    free(rules);
+    rules = NULL;
+    num_rules = 0;
+}
+
+// the rule for most processes, then for the largest size, that still applies wins,
+// on a tie the later one; without any the first algorithm is used
+int tuning_select(collective_t collective, int ranks, size_t bytes) {
+    if (forced[collective] >= 0) return forced[collective];
+
+    const rule_t* best = NULL;
+    for (int i = 0; i < num_rules; i++) {
+        const rule_t* rule = &rules[i];
+        if (rule->collective != collective || rule->ranks > ranks || rule->bytes > bytes) continue;
+        if (best == NULL || rule->ranks > best->ranks || (rule->ranks == best->ranks && rule->bytes >= best->bytes)) {
+            best = rule;
+        }
+    }
+    return best != NULL ? best->algorithm : 0;
+}
+
+// used by bench/tune to measure every algorithm, -1 goes back to the table
+void tuning_force(collective_t collective, int algorithm) {
+    forced[collective] = algorithm;
+}
+
+int num_algorithms(collective_t collective) {
+    int n = 0;
+    while (n < MAX_ALGORITHMS && algorithm_names[collective][n] != NULL) n++;
+    return n;
+}
+
+const char* collective_name(collective_t collective) {
+    return collective_names[collective];
+}
+
+const char* algorithm_name(collective_t collective, int algorithm) {
+    return algorithm_names[collective][algorithm];
+}
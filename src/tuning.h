@@ -0,0 +1,45 @@
+/**
+ * This file is for declarations of the collective algorithm selection:
+ * a table of rules, each saying which algorithm a collective uses from
+ * a number of processes and a message size on. Built-in defaults can be
+ * refined by a file generated by bench/tune, named by MIMPI_TUNING.
+ * */
+
+#ifndef TUNING_H
+#define TUNING_H
+
+#include <stddef.h>
+
+typedef enum {
+    COLL_BCAST,
+    COLL_ALLREDUCE,
+    COLL_GATHER,
+    COLL_SCATTER,
+    COLL_ALLGATHER,
+    NUM_COLLECTIVES,
+} collective_t;
+
+// algorithms of every collective, the first one is the fallback
+enum { BCAST_BINOMIAL, BCAST_CHAIN };
+enum { ALLREDUCE_DOUBLING, ALLREDUCE_RING };
+enum { GATHER_BINOMIAL, GATHER_LINEAR };
+enum { SCATTER_BINOMIAL, SCATTER_LINEAR };
+enum { ALLGATHER_RING, ALLGATHER_GATHER_BCAST };
+
+#define TUNING_VAR "MIMPI_TUNING"
+
+void tuning_load();
+
+void tuning_release();
+
+int tuning_select(collective_t collective, int ranks, size_t bytes);
+
+void tuning_force(collective_t collective, int algorithm);
+
+int num_algorithms(collective_t collective);
+
+const char* collective_name(collective_t collective);
+
+const char* algorithm_name(collective_t collective, int algorithm);
+
+#endif // TUNING_H